@@ -0,0 +1,226 @@
+// headless sph_sim benchmark, sweeps particle and thread counts and prints ns/particle/step per phase as json
+//
+// sph_bench [--counts=10000,100000] [--threads=1,4] [--steps=20] [--warmup=5] [--seed=42] [--skin=0]
+//           [--backend=hash|dense] [--symmetric] [--pcisph] [--cache=file] [--surface]
+//
+// skin is in units of h, every count gets the same neighborhood size since h shrinks with the particle spacing.
+// cache writes every timed step to a particle cache (overwritten per configuration) and reports its size.
+// surface meshes every timed step and reports ms per mesh and the triangles of the last one
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <filesystem>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+#if defined(XS_BENCH_TBB)
+#include <tbb/global_control.h>
+#endif
+
+#include "sim.hpp"
+#include "particle_cache.hpp"
+#include "fluid_surface.hpp"
+
+namespace
+{
+
+struct bench_params
+{
+	std::vector<std::size_t> counts = { 10000, 50000, 100000, 500000, 1000000, 2000000 };
+	std::vector<std::uint32_t> threads = {};
+	std::uint32_t steps = 20;
+	std::uint32_t warmup = 5;
+	std::uint64_t seed = 42;
+	float skin = 0.f;
+	xs::sim::grid_backend backend = xs::sim::grid_backend::dense;
+	bool symmetric = false;
+	bool pcisph = false;
+	std::string cache = {};
+	bool surface = false;
+};
+
+template<typename T>
+std::vector<T> parse_list(const std::string& str)
+{
+	std::vector<T> values;
+	std::size_t begin = 0;
+	while (begin < str.size())
+	{
+		std::size_t end = str.find(',', begin);
+		end = end == std::string::npos ? str.size() : end;
+		values.push_back(T(std::strtoull(str.substr(begin, end - begin).c_str(), nullptr, 10)));
+		begin = end + 1;
+	}
+	return values;
+}
+
+bool parse_args(const int argc, char** argv, bench_params& params)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		const std::size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+		if (key == "--counts") params.counts = parse_list<std::size_t>(value);
+		else if (key == "--threads") params.threads = parse_list<std::uint32_t>(value);
+		else if (key == "--steps") params.steps = std::uint32_t(std::strtoul(value.c_str(), nullptr, 10));
+		else if (key == "--warmup") params.warmup = std::uint32_t(std::strtoul(value.c_str(), nullptr, 10));
+		else if (key == "--seed") params.seed = std::strtoull(value.c_str(), nullptr, 10);
+		else if (key == "--skin") params.skin = std::strtof(value.c_str(), nullptr);
+		else if (key == "--backend") params.backend = value == "hash" ? xs::sim::grid_backend::hash : xs::sim::grid_backend::dense;
+		else if (key == "--symmetric") params.symmetric = true;
+		else if (key == "--pcisph") params.pcisph = true;
+		else if (key == "--cache") params.cache = value;
+		else if (key == "--surface") params.surface = true;
+		else
+		{
+			std::fprintf(stderr, "unknown argument %s\n", arg.c_str());
+			return false;
+		}
+	}
+
+	if (params.threads.empty())
+	{
+		const std::uint32_t hw = (std::max)(1u, std::thread::hardware_concurrency());
+		for (std::uint32_t t = 1; t < hw; t *= 2)
+		{
+			params.threads.push_back(t);
+		}
+		params.threads.push_back(hw);
+	}
+	return params.steps > 0 && !params.counts.empty();
+}
+
+// caps the openmp loops left in spatial_hash_table and the std::execution::par algorithms, the per particle passes
+// get their own scheduler. msvc's parallel algorithms run on the windows thread pool which can't be capped
+class thread_limit
+{
+public:
+	explicit thread_limit(const std::uint32_t threads)
+#if defined(XS_BENCH_TBB)
+		: tbb_limit_(tbb::global_control::max_allowed_parallelism, threads)
+#endif
+	{
+#if defined(_OPENMP)
+		omp_set_num_threads(int(threads));
+#endif
+	}
+
+private:
+#if defined(XS_BENCH_TBB)
+	tbb::global_control tbb_limit_;
+#endif
+};
+
+}
+
+int main(int argc, char** argv)
+{
+	bench_params params;
+	if (!parse_args(argc, argv, params))
+	{
+		return 1;
+	}
+
+	std::printf("{\n");
+	std::printf("  \"seed\": %llu, \"steps\": %u, \"warmup\": %u, \"skin\": %g, \"backend\": \"%s\",\n",
+		static_cast<unsigned long long>(params.seed), params.steps, params.warmup, params.skin,
+		params.backend == xs::sim::grid_backend::hash ? "hash" : "dense");
+	std::printf("  \"pair_evaluation\": \"%s\", \"pressure_solver\": \"%s\", \"hardware_threads\": %u, \"avx2\": %s,\n",
+		params.symmetric ? "symmetric" : "gather", params.pcisph ? "pcisph" : "state_equation",
+		std::thread::hardware_concurrency(),
+#if defined(__AVX2__)
+		"true"
+#else
+		"false"
+#endif
+	);
+	std::printf("  \"results\": [");
+
+	bool first = true;
+	for (const std::size_t count : params.counts)
+	{
+		for (const std::uint32_t threads : params.threads)
+		{
+			thread_limit limit(threads);
+
+			// same 2 unit block for every count with h at the resting spacing, so neighborhoods stay the same size
+			const float h = 2.f / std::cbrt(float(count));
+			const xs::sim::range3_t block = { xs::mth::vec3f_replicate(-1.f), xs::mth::vec3f_replicate(1.f) };
+			// a container with a quarter of the block's size of room on every side instead of the default one, its
+			// samples go with its area over h^2 so it scales with the fluid instead of dwarfing it at high counts
+			const Eigen::Vector3f margin = (block[1] - block[0]) * .25f;
+			const xs::sim::range3_t container = { block[0] - margin, block[1] + margin };
+			std::unique_ptr<xs::sph_sim> sim = std::make_unique<xs::sph_sim>(block, count, h, 1000.f, 1.f, params.skin * h,
+				params.backend, xs::sim::reorder_policy{}, xs::mth::pcg32(params.seed), container);
+			sim->set_scheduler(std::make_shared<xs::sim::tile_scheduler>(threads));
+			if (params.symmetric)
+			{
+				sim->set_pair_evaluation(xs::sim::pair_evaluation::symmetric);
+			}
+			if (params.pcisph)
+			{
+				sim->set_pressure_solver(xs::sim::pressure_solver::pcisph);
+			}
+
+			const float dt = params.pcisph ? .002f : .0005f;
+			for (std::uint32_t step = 0; step < params.warmup; step++)
+			{
+				sim->update(dt);
+			}
+
+			sim->reset_timings();
+			std::unique_ptr<xs::particle_cache::writer> cache = params.cache.empty() ? nullptr : std::make_unique<xs::particle_cache::writer>(params.cache);
+			std::unique_ptr<xs::fluid_surface> surface = params.surface ? std::make_unique<xs::fluid_surface>() : nullptr;
+			std::chrono::duration<double> surface_time(0.);
+			std::vector<xs::sim::particle> exported;
+			for (std::uint32_t step = 0; step < params.steps; step++)
+			{
+				sim->update(dt);
+				if (cache)
+				{
+					sim->copy_particles(exported);
+					cache->write_frame(exported, double(step) * dt);
+				}
+				if (surface)
+				{
+					const auto start = std::chrono::steady_clock::now();
+					surface->extract(*sim);
+					surface_time += std::chrono::steady_clock::now() - start;
+				}
+			}
+			double cache_bytes = 0.;
+			if (cache)
+			{
+				cache->close();
+				cache_bytes = double(std::filesystem::file_size(params.cache)) / (double(count) * double(params.steps));
+			}
+
+			const xs::sim::step_timings& timings = sim->timings();
+			const double to_ns = 1e9 / (double(count) * double(timings.steps));
+			const double density_ns = timings.density.count() * to_ns;
+			const double force_ns = timings.force.count() * to_ns;
+			const double grid_ns = timings.grid.count() * to_ns;
+			const double neighbors_ns = timings.neighbors.count() * to_ns;
+			const double surface_ms = surface_time.count() * 1e3 / double(params.steps);
+			const std::size_t surface_triangles = surface ? surface->surface().triangles.size() : 0;
+			std::printf("%s\n    { \"particles\": %zu, \"threads\": %u, \"h\": %g, \"density_ns\": %.3f, \"force_ns\": %.3f, "
+				"\"grid_update_ns\": %.3f, \"neighbor_lists_ns\": %.3f, \"cache_bytes\": %.3f, \"surface_ms\": %.3f, \"surface_triangles\": %zu }",
+				first ? "" : ",", count, threads, h, density_ns, force_ns, grid_ns, neighbors_ns, cache_bytes, surface_ms, surface_triangles);
+			std::fflush(stdout);
+			first = false;
+		}
+	}
+
+	std::printf("\n  ]\n}\n");
+	return 0;
+}
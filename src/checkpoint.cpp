@@ -0,0 +1,301 @@
+#include "checkpoint.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace xs
+{
+
+mapped_file::mapped_file(const std::string& filename)
+{
+#if defined(_WIN32)
+    file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+        file_ = nullptr;
+        throw std::runtime_error("Failed to open file!");
+    }
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file_, &size);
+    size_ = std::size_t(size.QuadPart);
+    if (size_ == 0)
+    {
+        return;
+    }
+
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    const void* view = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!view)
+    {
+        unmap();
+        throw std::runtime_error("Failed to map file!");
+    }
+    data_ = static_cast<const std::byte*>(view);
+#else
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open file!");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Failed to open file!");
+    }
+    size_ = std::size_t(st.st_size);
+    if (size_ == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    // the mapping keeps the file alive by itself
+    void* view = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+    {
+        size_ = 0;
+        throw std::runtime_error("Failed to map file!");
+    }
+    data_ = static_cast<const std::byte*>(view);
+#endif
+}
+
+mapped_file::~mapped_file()
+{
+    unmap();
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept
+{
+    if (this != &other)
+    {
+        unmap();
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+#if defined(_WIN32)
+        std::swap(file_, other.file_);
+        std::swap(mapping_, other.mapping_);
+#endif
+    }
+    return *this;
+}
+
+void mapped_file::unmap()
+{
+#if defined(_WIN32)
+    if (data_)
+    {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_)
+    {
+        CloseHandle(mapping_);
+    }
+    if (file_)
+    {
+        CloseHandle(file_);
+    }
+    file_ = nullptr;
+    mapping_ = nullptr;
+#else
+    if (data_)
+    {
+        munmap(const_cast<std::byte*>(data_), size_);
+    }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
+
+namespace checkpoint
+{
+    static inline std::uint64_t align_up(const std::uint64_t offset)
+    {
+        return (offset + section_alignment - 1) / section_alignment * section_alignment;
+    }
+
+    // ofstream can't sync, so the file (or a directory, for a rename in it) is opened again just for that
+    static bool sync_to_disk(const std::string& filename, const bool directory)
+    {
+#if defined(_WIN32)
+        // renames are journaled by ntfs, and a directory can't be flushed here anyway
+        if (directory)
+        {
+            return true;
+        }
+        const HANDLE file = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        const bool synced = FlushFileBuffers(file) != 0;
+        CloseHandle(file);
+        return synced;
+#else
+        const int fd = open(filename.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_WRONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        const bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+#endif
+    }
+
+    void writer::write(const std::string& filename) const
+    {
+        std::vector<section> table;
+        table.reserve(sections_.size());
+        std::uint64_t offset = align_up(sizeof(header) + sections_.size() * sizeof(section));
+        for (const pending_section& pending : sections_)
+        {
+            table.push_back({ pending.tag, pending.element_size, offset, pending.size });
+            offset = align_up(offset + pending.size);
+        }
+
+        const header head = {
+            .magic = magic,
+            .version = version,
+            .file_kind = file_kind_,
+            .num_sections = table.size(),
+            .file_size = offset
+        };
+
+        const std::string temp_filename = filename + ".tmp";
+        {
+            std::ofstream file(temp_filename, std::ios::binary | std::ios::trunc);
+            if (!file.is_open())
+            {
+                throw std::runtime_error("Failed to open file!");
+            }
+
+            static constexpr std::array<char, section_alignment> padding = {};
+            const auto pad_to = [&](const std::uint64_t target) {
+                const std::uint64_t pos = std::uint64_t(file.tellp());
+                file.write(padding.data(), std::streamsize(target - pos));
+            };
+
+            file.write(reinterpret_cast<const char*>(&head), sizeof(head));
+            file.write(reinterpret_cast<const char*>(table.data()), std::streamsize(table.size() * sizeof(section)));
+            for (std::size_t i = 0; i < sections_.size(); i++)
+            {
+                const pending_section& pending = sections_[i];
+                pad_to(table[i].offset);
+                const std::byte* data = pending.owned.empty() ? pending.data : pending.owned.data();
+                file.write(reinterpret_cast<const char*>(data), std::streamsize(pending.size));
+            }
+            pad_to(offset);
+
+            file.close();
+            if (file.fail())
+            {
+                throw std::runtime_error("Failed to write checkpoint!");
+            }
+        }
+
+        // the data has to be on disk before the rename is, or a crash can leave the new name pointing at a hole
+        if (!sync_to_disk(temp_filename, false))
+        {
+            throw std::runtime_error("Failed to write checkpoint!");
+        }
+
+        std::error_code error;
+        std::filesystem::rename(temp_filename, filename, error);
+        if (error)
+        {
+            throw std::runtime_error("Failed to write checkpoint!");
+        }
+
+        const std::filesystem::path directory = std::filesystem::path(filename).parent_path();
+        sync_to_disk(directory.empty() ? std::string(".") : directory.string(), true);
+    }
+
+    reader::reader(const std::string& filename, const kind file_kind) :
+        file_(filename),
+        sections_()
+    {
+        const std::span<const std::byte> bytes = file_.bytes();
+        if (bytes.size() < sizeof(header))
+        {
+            throw std::runtime_error("not a checkpoint file");
+        }
+
+        header head;
+        std::memcpy(&head, bytes.data(), sizeof(head));
+        if (head.magic != magic)
+        {
+            throw std::runtime_error("not a checkpoint file");
+        }
+        if (head.version != version)
+        {
+            throw std::runtime_error("checkpoint version mismatch");
+        }
+        if (head.file_kind != file_kind)
+        {
+            throw std::runtime_error("checkpoint is of another kind of sim");
+        }
+        // divided and subtracted instead of multiplied and added, a corrupt count or offset can't wrap around then
+        if (head.file_size != bytes.size() || head.num_sections > (bytes.size() - sizeof(header)) / sizeof(section))
+        {
+            throw std::runtime_error("checkpoint is truncated");
+        }
+
+        sections_ = std::span<const section>(reinterpret_cast<const section*>(bytes.data() + sizeof(header)), head.num_sections);
+        for (const section& s : sections_)
+        {
+            if (s.offset % section_alignment != 0 || s.offset > bytes.size() || s.size > bytes.size() - s.offset)
+            {
+                throw std::runtime_error("checkpoint is truncated");
+            }
+        }
+    }
+
+    const section* reader::find(const std::uint32_t tag) const
+    {
+        for (const section& s : sections_)
+        {
+            if (s.tag == tag)
+            {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    std::span<const std::byte> reader::section_bytes(const std::uint32_t tag, const std::size_t element_size) const
+    {
+        const section* s = find(tag);
+        if (!s)
+        {
+            throw std::runtime_error("checkpoint section missing");
+        }
+        if (s->element_size != element_size || s->size % element_size != 0)
+        {
+            throw std::runtime_error("checkpoint section has a different layout");
+        }
+        return file_.bytes().subspan(s->offset, s->size);
+    }
+}
+
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace xs
+{
+
+// read only view of a whole file, unmapped again on destruction
+class mapped_file
+{
+public:
+	mapped_file() = default;
+	// throws std::runtime_error if the file can't be opened or mapped
+	explicit mapped_file(const std::string& filename);
+	~mapped_file();
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	mapped_file(mapped_file&& other) noexcept;
+	mapped_file& operator=(mapped_file&& other) noexcept;
+
+	std::span<const std::byte> bytes() const { return std::span<const std::byte>(data_, size_); }
+
+private:
+	void unmap();
+
+	const std::byte* data_ = nullptr;
+	std::size_t size_ = 0;
+#if defined(_WIN32)
+	void* file_ = nullptr;
+	void* mapping_ = nullptr;
+#endif
+};
+
+/*
+ * checkpoint files are a header, a table of tagged sections and then the sections themselves, each one 64 byte
+ * aligned so arrays can be used straight out of the mapping. everything is in native byte order and struct layout,
+ * the table keeps the element size of every section so a layout change gets caught instead of read as garbage.
+ * bump version whenever a section changes meaning
+ */
+namespace checkpoint
+{
+	static constexpr std::uint32_t version = 9;
+	static constexpr std::size_t section_alignment = 64;
+
+	enum class kind : std::uint32_t
+	{
+		sph_sim = 1,
+		cloth = 2
+	};
+
+	constexpr std::uint32_t tag(const char (&name)[5])
+	{
+		return std::uint32_t(name[0]) | (std::uint32_t(name[1]) << 8) | (std::uint32_t(name[2]) << 16) | (std::uint32_t(name[3]) << 24);
+	}
+
+	struct header
+	{
+		std::array<char, 8> magic;
+		std::uint32_t version;
+		kind file_kind;
+		std::uint64_t num_sections;
+		std::uint64_t file_size;
+	};
+
+	struct section
+	{
+		std::uint32_t tag;
+		std::uint32_t element_size;
+		std::uint64_t offset;
+		std::uint64_t size; // in bytes
+	};
+
+	static constexpr std::array<char, 8> magic = { 'x', 's', 'c', 'k', 'p', 't', '\0', '\0' };
+
+	class writer
+	{
+	public:
+		explicit writer(const kind file_kind) : file_kind_(file_kind), sections_() {}
+
+		// arrays aren't copied, they have to stay alive and unchanged until write()
+		template<typename T>
+		void add(const std::uint32_t tag, const std::span<const T> data)
+		{
+			static_assert(std::is_standard_layout_v<T>);
+			sections_.push_back({ tag, std::uint32_t(sizeof(T)), reinterpret_cast<const std::byte*>(data.data()), data.size_bytes(), {} });
+		}
+
+		template<typename T>
+		void add_value(const std::uint32_t tag, const T& value)
+		{
+			static_assert(std::is_standard_layout_v<T>);
+			std::vector<std::byte> bytes(sizeof(T));
+			std::memcpy(bytes.data(), &value, sizeof(T));
+			sections_.push_back({ tag, std::uint32_t(sizeof(T)), nullptr, sizeof(T), std::move(bytes) });
+		}
+
+		// writes next to filename first and renames it over, so a crash halfway leaves the last checkpoint alone.
+		// throws std::runtime_error on failure
+		void write(const std::string& filename) const;
+
+	private:
+		struct pending_section
+		{
+			std::uint32_t tag;
+			std::uint32_t element_size;
+			const std::byte* data;
+			std::size_t size;
+			std::vector<std::byte> owned; // values are copied in
+		};
+
+		kind file_kind_;
+		std::vector<pending_section> sections_;
+	};
+
+	class reader
+	{
+	public:
+		// maps the file and checks the header, throws std::runtime_error if it isn't a checkpoint of this version and kind
+		reader(const std::string& filename, const kind file_kind);
+
+		bool has(const std::uint32_t tag) const { return find(tag) != nullptr; }
+
+		// views into the mapping, valid as long as the reader. throws if the section is missing or has another element size
+		template<typename T>
+		std::span<const T> get(const std::uint32_t tag) const
+		{
+			static_assert(std::is_standard_layout_v<T>);
+			const std::span<const std::byte> bytes = section_bytes(tag, sizeof(T));
+			return std::span<const T>(reinterpret_cast<const T*>(bytes.data()), bytes.size() / sizeof(T));
+		}
+
+		template<typename T>
+		T value(const std::uint32_t tag) const
+		{
+			static_assert(std::is_standard_layout_v<T> && std::is_trivially_copyable_v<T>);
+			const std::span<const std::byte> bytes = section_bytes(tag, sizeof(T));
+			if (bytes.size() != sizeof(T))
+			{
+				throw std::runtime_error("checkpoint value has the wrong size");
+			}
+
+			T value;
+			std::memcpy(&value, bytes.data(), sizeof(T));
+			return value;
+		}
+
+	private:
+		const section* find(const std::uint32_t tag) const;
+		std::span<const std::byte> section_bytes(const std::uint32_t tag, const std::size_t element_size) const;
+
+		mapped_file file_;
+		std::span<const section> sections_;
+	};
+}
+
+}
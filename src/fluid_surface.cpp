@@ -0,0 +1,523 @@
+#include "fluid_surface.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <execution>
+#include <numeric>
+
+namespace xs
+{
+
+namespace
+{
+    // marching cubes corners are bit i of the config, at (i & 1, i >> 1 & 1, i >> 2 & 1). edge axis * 4 + k runs
+    // along axis from the corner whose other two bits are k. every config gets up to 5 triangles as edge triples
+    using cube_table = std::array<std::array<std::int8_t, 16>, 256>;
+
+    std::uint32_t cube_edge(const std::uint32_t u, const std::uint32_t v)
+    {
+        const std::uint32_t lo = (std::min)(u, v), axis = std::uint32_t(std::countr_zero(u ^ v));
+        const std::uint32_t b = (axis + 1) % 3, c = (axis + 2) % 3;
+        return axis * 4 + ((lo >> b) & 1) + (((lo >> c) & 1) << 1);
+    }
+
+    std::uint32_t edge_corner(const std::uint32_t edge)
+    {
+        const std::uint32_t axis = edge / 4, k = edge % 4, b = (axis + 1) % 3, c = (axis + 2) % 3;
+        return ((k & 1) << b) | ((k >> 1) << c);
+    }
+
+    // bit axis * 2 + side of the two faces an edge is on
+    std::uint32_t edge_faces(const std::uint32_t edge)
+    {
+        const std::uint32_t axis = edge / 4, k = edge % 4, b = (axis + 1) % 3, c = (axis + 2) % 3;
+        return (1u << (b * 2 + (k & 1))) | (1u << (c * 2 + (k >> 1)));
+    }
+
+    // instead of the usual hand made table, the surface is traced over the faces of the cube. going counterclockwise
+    // round a face seen from outside, a segment runs from every edge leaving the inside to the last edge entering it,
+    // so the inside corners of an ambiguous face are always kept apart and both cubes sharing the face agree.
+    // the segments chain into loops round the cube that get fanned into triangles facing out of the inside
+    cube_table make_cube_table()
+    {
+        cube_table table;
+        for (std::uint32_t config = 0; config < 256; config++)
+        {
+            const auto inside = [config](const std::uint32_t corner) { return ((config >> corner) & 1) != 0; };
+
+            std::array<std::int8_t, 12> next;
+            next.fill(-1);
+            for (std::uint32_t face = 0; face < 6; face++)
+            {
+                const std::uint32_t axis = face / 2, side = face % 2, b = (axis + 1) % 3, c = (axis + 2) % 3;
+                std::array<std::uint32_t, 4> corners = { 0, 1u << b, (1u << b) | (1u << c), 1u << c };
+                if (!side)
+                {
+                    std::swap(corners[1], corners[3]);
+                }
+                for (std::uint32_t& corner : corners)
+                {
+                    corner |= side << axis;
+                }
+
+                for (std::uint32_t j = 0; j < 4; j++)
+                {
+                    if (!inside(corners[j]) || inside(corners[(j + 1) % 4]))
+                    {
+                        continue;
+                    }
+                    for (std::uint32_t back = 1; back < 4; back++)
+                    {
+                        const std::uint32_t i = (j + 4 - back) % 4;
+                        if (!inside(corners[i]) && inside(corners[(i + 1) % 4]))
+                        {
+                            next[cube_edge(corners[j], corners[(j + 1) % 4])] = std::int8_t(cube_edge(corners[i], corners[(i + 1) % 4]));
+                            break;
+                        }
+                    }
+                }
+            }
+
+            table[config].fill(-1);
+            std::uint32_t out = 0;
+            std::array<bool, 12> traced = {};
+            for (std::uint32_t start = 0; start < 12; start++)
+            {
+                if (next[start] < 0 || traced[start])
+                {
+                    continue;
+                }
+
+                std::array<std::int8_t, 12> loop;
+                std::uint32_t length = 0;
+                for (std::int8_t edge = std::int8_t(start); !traced[edge]; edge = next[edge])
+                {
+                    traced[edge] = true;
+                    loop[length++] = edge;
+                }
+                // a loop through both segments of an ambiguous face could get a triangle lying flat in that face, the
+                // cube on the other side would make it too facing the other way. the fan starts where it doesn't
+                std::uint32_t first = 0;
+                for (; first < length; first++)
+                {
+                    bool flat = false;
+                    for (std::uint32_t k = 1; k + 1 < length; k++)
+                    {
+                        const std::uint32_t a = loop[first], b = loop[(first + k) % length], c = loop[(first + k + 1) % length];
+                        flat = flat || (edge_faces(a) & edge_faces(b) & edge_faces(c)) != 0;
+                    }
+                    if (!flat)
+                    {
+                        break;
+                    }
+                }
+
+                for (std::uint32_t k = 1; k + 1 < length; k++)
+                {
+                    table[config][out++] = loop[first % length];
+                    table[config][out++] = loop[(first + k + 1) % length];
+                    table[config][out++] = loop[(first + k) % length];
+                }
+            }
+        }
+        return table;
+    }
+
+    const cube_table& cube_triangles()
+    {
+        static const cube_table table = make_cube_table();
+        return table;
+    }
+
+    // 21 bits per axis, centered so negative coords work
+    constexpr std::int32_t block_bias = 1 << 20;
+
+    // lattice edges are 20 bits per axis and the axis in the low 2 bits
+    constexpr std::int32_t lattice_bias = 1 << 19;
+
+    inline std::uint64_t lattice_edge(const std::int32_t x, const std::int32_t y, const std::int32_t z, const std::uint32_t axis)
+    {
+        const std::uint64_t ux = std::uint32_t(x + lattice_bias), uy = std::uint32_t(y + lattice_bias), uz = std::uint32_t(z + lattice_bias);
+        return (((ux << 40) | (uy << 20) | uz) << 2) | axis;
+    }
+}
+
+fluid_surface::fluid_surface(const fluid_surface_params& params) :
+    params_(params),
+    cell_size_(0.f),
+    inv_cell_size_(0.f),
+    block_size_(0.f),
+    inv_rest_sum_(0.f),
+    snapshots_()
+#if !defined(XS_HEADLESS)
+    , max_triangles_(0),
+    drawn_triangles_(0)
+#endif
+{
+    cube_triangles();
+
+    // kernel sum of a particle in a lattice at spacing h, which is how far apart particles are at the rest density
+    float rest_sum = 0.f;
+    for (std::int32_t z = -2; z <= 2; z++)
+    {
+        for (std::int32_t y = -2; y <= 2; y++)
+        {
+            for (std::int32_t x = -2; x <= 2; x++)
+            {
+                rest_sum += sim::cubic_kernel(std::sqrt(float(x * x + y * y + z * z)));
+            }
+        }
+    }
+    inv_rest_sum_ = 1.f / rest_sum;
+}
+
+void fluid_surface::extract(const sph_sim& sim)
+{
+    const float h = sim.smoothing_length();
+    cell_size_ = params_.cell_size * h;
+    inv_cell_size_ = 1.f / cell_size_;
+    block_size_ = cell_size_ * float(block_cells);
+
+    collect_blocks(sim);
+    block_meshes_.resize(blocks_.size());
+
+    const std::int64_t num_blocks = blocks_.size();
+#pragma omp parallel for schedule(dynamic, 1)
+    for (std::int64_t b = 0; b < num_blocks; b++)
+    {
+        mesh_block(sim, b);
+    }
+    weld();
+
+    mesh& published = snapshots_.back();
+    published.vertices.assign(std::begin(mesh_.vertices), std::end(mesh_.vertices));
+    published.normals.assign(std::begin(mesh_.normals), std::end(mesh_.normals));
+    published.triangles.assign(std::begin(mesh_.triangles), std::end(mesh_.triangles));
+    snapshots_.publish();
+}
+
+void fluid_surface::collect_blocks(const sph_sim& sim)
+{
+    // every surface particle touches the blocks its kernel support overlaps. count, scan, then fill, a particle
+    // deep inside the fluid adds nothing
+    const sim::particle_soa& particles = sim.particles();
+    const std::int64_t n = particles.size();
+    const float support = 2.f * sim.smoothing_length();
+    const float min_density = params_.surface_density * sim.rest_density();
+    const float inv_block_size = 1.f / block_size_;
+    const auto block_range = [&](const Eigen::Vector3f& pos, std::array<std::int32_t, 3>& lo, std::array<std::int32_t, 3>& hi) {
+        for (std::size_t axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = std::int32_t(std::floor((pos[axis] - support) * inv_block_size));
+            hi[axis] = std::int32_t(std::floor((pos[axis] + support) * inv_block_size));
+        }
+    };
+
+    particle_offsets_.resize(n + 1);
+    particle_offsets_[0] = 0;
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        std::uint32_t count = 0;
+        if (particles.density[i] < min_density)
+        {
+            std::array<std::int32_t, 3> lo, hi;
+            block_range(particles.position(i), lo, hi);
+            count = std::uint32_t(hi[0] - lo[0] + 1) * std::uint32_t(hi[1] - lo[1] + 1) * std::uint32_t(hi[2] - lo[2] + 1);
+        }
+        particle_offsets_[i + 1] = count;
+    }
+    std::inclusive_scan(std::execution::par, std::begin(particle_offsets_), std::end(particle_offsets_), std::begin(particle_offsets_));
+
+    block_keys_.resize(particle_offsets_[n]);
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        if (particle_offsets_[i] == particle_offsets_[i + 1])
+        {
+            continue;
+        }
+
+        std::array<std::int32_t, 3> lo, hi;
+        block_range(particles.position(i), lo, hi);
+        std::uint32_t out = particle_offsets_[i];
+        for (std::int32_t z = lo[2]; z <= hi[2]; z++)
+        {
+            for (std::int32_t y = lo[1]; y <= hi[1]; y++)
+            {
+                for (std::int32_t x = lo[0]; x <= hi[0]; x++)
+                {
+                    block_keys_[out++] = sim::morton_encode(std::uint32_t(x + block_bias), std::uint32_t(y + block_bias), std::uint32_t(z + block_bias));
+                }
+            }
+        }
+    }
+
+    // neighboring particles mostly touch the same blocks, so the keys are mostly runs already
+    std::sort(std::execution::par, std::begin(block_keys_), std::end(block_keys_));
+    block_keys_.erase(std::unique(std::begin(block_keys_), std::end(block_keys_)), std::end(block_keys_));
+
+    blocks_.resize(block_keys_.size());
+    std::transform(std::execution::par, std::begin(block_keys_), std::end(block_keys_), std::begin(blocks_), [](const std::uint64_t key) {
+        const sim::size3_t coords = sim::morton_decode(key);
+        return std::array<std::int32_t, 3>{ std::int32_t(coords[0]) - block_bias, std::int32_t(coords[1]) - block_bias, std::int32_t(coords[2]) - block_bias };
+    });
+}
+
+void fluid_surface::mesh_block(const sph_sim& sim, const std::size_t b)
+{
+    // color field samples on the block's lattice with a layer of padding, so the central differences for the normals
+    // come out the same on both sides of a block border
+    static constexpr std::int32_t cells = block_cells;
+    static constexpr std::int32_t padded = cells + 3;
+    static constexpr std::int32_t points = cells + 1;
+    std::array<float, padded * padded * padded> field;
+    field.fill(0.f);
+    const auto sample = [&](const std::int32_t x, const std::int32_t y, const std::int32_t z) -> float& {
+        return field[((z + 1) * padded + (y + 1)) * padded + (x + 1)];
+    };
+
+    const std::array<std::int32_t, 3> lattice = { blocks_[b][0] * cells, blocks_[b][1] * cells, blocks_[b][2] * cells };
+    const Eigen::Vector3f origin = Eigen::Vector3f(float(lattice[0]), float(lattice[1]), float(lattice[2])) * cell_size_;
+    const float h = sim.smoothing_length();
+    const float inv_h = 1.f / h;
+    const float support = 2.f * h;
+
+    // splat every particle within reach of the padded lattice. the samples on a border have to come out bit for bit
+    // the same in both blocks or the meshes won't meet, so distances are taken from the global lattice and the
+    // particles get summed in index order
+    block_mesh& out = block_meshes_[b];
+    out.particles.clear();
+    const Eigen::Vector3f reach = mth::vec3f_replicate(support + cell_size_);
+    sim.grid().for_each_in_box(origin - reach, origin + mth::vec3f_replicate(block_size_) + reach, [&](const std::uint32_t idx) {
+        out.particles.push_back(idx);
+    });
+    std::sort(std::begin(out.particles), std::end(out.particles));
+
+    const sim::particle_soa& particles = sim.particles();
+    for (const std::uint32_t idx : out.particles)
+    {
+        const Eigen::Vector3f pos = particles.position(idx);
+        const Eigen::Vector3f local = (pos - origin) * inv_cell_size_;
+        const float reach_cells = support * inv_cell_size_;
+        std::array<std::int32_t, 3> lo, hi;
+        for (std::size_t axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = (std::max)(-1, std::int32_t(std::ceil(local[axis] - reach_cells)));
+            hi[axis] = (std::min)(cells + 1, std::int32_t(std::floor(local[axis] + reach_cells)));
+        }
+
+        for (std::int32_t z = lo[2]; z <= hi[2]; z++)
+        {
+            const float dz = float(lattice[2] + z) * cell_size_ - pos.z();
+            for (std::int32_t y = lo[1]; y <= hi[1]; y++)
+            {
+                const float dy = float(lattice[1] + y) * cell_size_ - pos.y();
+                const float dyz2 = dy * dy + dz * dz;
+                for (std::int32_t x = lo[0]; x <= hi[0]; x++)
+                {
+                    const float dx = float(lattice[0] + x) * cell_size_ - pos.x();
+                    const float q = std::sqrt(dx * dx + dyz2) * inv_h;
+                    if (q < 2.f)
+                    {
+                        sample(x, y, z) += inv_rest_sum_ * sim::cubic_kernel(q);
+                    }
+                }
+            }
+        }
+    }
+
+    out.edges.clear();
+    out.vertices.clear();
+    out.normals.clear();
+    out.indices.clear();
+
+    const float iso = params_.iso;
+    const auto gradient = [&](const std::int32_t x, const std::int32_t y, const std::int32_t z) {
+        return Eigen::Vector3f(sample(x + 1, y, z) - sample(x - 1, y, z), sample(x, y + 1, z) - sample(x, y - 1, z), sample(x, y, z + 1) - sample(x, y, z - 1));
+    };
+
+    // vertex of every lattice edge in the block, made the first time a cube needs it
+    std::array<std::int32_t, points * points * points * 3> edge_vertices;
+    edge_vertices.fill(-1);
+    const auto vertex = [&](const std::int32_t x, const std::int32_t y, const std::int32_t z, const std::uint32_t axis) {
+        std::int32_t& index = edge_vertices[((z * points + y) * points + x) * 3 + axis];
+        if (index < 0)
+        {
+            const std::int32_t x1 = x + (axis == 0), y1 = y + (axis == 1), z1 = z + (axis == 2);
+            const float a = sample(x, y, z), b = sample(x1, y1, z1);
+            const float t = (iso - a) / (b - a);
+            Eigen::Vector3f pos = Eigen::Vector3f(float(lattice[0] + x), float(lattice[1] + y), float(lattice[2] + z));
+            pos[axis] += t;
+
+            // the field falls off outwards
+            const Eigen::Vector3f normal = -(gradient(x, y, z) * (1.f - t) + gradient(x1, y1, z1) * t);
+            index = std::int32_t(out.vertices.size());
+            out.edges.push_back(lattice_edge(lattice[0] + x, lattice[1] + y, lattice[2] + z, axis));
+            out.vertices.push_back(pos * cell_size_);
+            out.normals.push_back(normal.normalized());
+        }
+        return std::uint32_t(index);
+    };
+
+    const cube_table& table = cube_triangles();
+    for (std::int32_t z = 0; z < cells; z++)
+    {
+        for (std::int32_t y = 0; y < cells; y++)
+        {
+            for (std::int32_t x = 0; x < cells; x++)
+            {
+                std::uint32_t config = 0;
+                for (std::uint32_t corner = 0; corner < 8; corner++)
+                {
+                    config |= (sample(x + (corner & 1), y + ((corner >> 1) & 1), z + ((corner >> 2) & 1)) >= iso ? 1u : 0u) << corner;
+                }
+
+                for (const std::int8_t edge : table[config])
+                {
+                    if (edge < 0)
+                    {
+                        break;
+                    }
+                    const std::uint32_t corner = edge_corner(edge);
+                    out.indices.push_back(vertex(x + (corner & 1), y + ((corner >> 1) & 1), z + ((corner >> 2) & 1), edge / 4));
+                }
+            }
+        }
+    }
+}
+
+void fluid_surface::weld()
+{
+    // vertices on a block border were made by every block next to it, the copies share their lattice edge. sorting by
+    // edge puts them next to each other and the first one of every run is kept
+    const std::int64_t num_blocks = block_meshes_.size();
+    vertex_offsets_.resize(num_blocks + 1);
+    index_offsets_.resize(num_blocks + 1);
+    vertex_offsets_[0] = 0;
+    index_offsets_[0] = 0;
+    for (std::int64_t b = 0; b < num_blocks; b++)
+    {
+        vertex_offsets_[b + 1] = vertex_offsets_[b] + std::uint32_t(block_meshes_[b].vertices.size());
+        index_offsets_[b + 1] = index_offsets_[b] + std::uint32_t(block_meshes_[b].indices.size());
+    }
+
+    const std::int64_t num_copies = vertex_offsets_[num_blocks];
+    edge_vertices_.resize(num_copies);
+#pragma omp parallel for
+    for (std::int64_t b = 0; b < num_blocks; b++)
+    {
+        const block_mesh& block = block_meshes_[b];
+        for (std::uint32_t v = 0; v < block.edges.size(); v++)
+        {
+            edge_vertices_[vertex_offsets_[b] + v] = edge_vertex{ block.edges[v], std::uint32_t(b), v };
+        }
+    }
+    std::sort(std::execution::par, std::begin(edge_vertices_), std::end(edge_vertices_), [](const edge_vertex& a, const edge_vertex& b) {
+        return a.edge < b.edge || (a.edge == b.edge && (a.block < b.block || (a.block == b.block && a.index < b.index)));
+    });
+
+    // 1 at the start of every run, scanned into the welded index + 1
+    run_ids_.resize(num_copies);
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < num_copies; i++)
+    {
+        run_ids_[i] = i == 0 || edge_vertices_[i - 1].edge != edge_vertices_[i].edge ? 1 : 0;
+    }
+    std::inclusive_scan(std::execution::par, std::begin(run_ids_), std::end(run_ids_), std::begin(run_ids_));
+
+    const std::size_t num_vertices = num_copies > 0 ? run_ids_.back() : 0;
+    mesh_.vertices.resize(num_vertices);
+    mesh_.normals.resize(num_vertices);
+    welded_.resize(num_copies);
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < num_copies; i++)
+    {
+        const edge_vertex& copy = edge_vertices_[i];
+        const std::uint32_t welded = run_ids_[i] - 1;
+        welded_[vertex_offsets_[copy.block] + copy.index] = welded;
+        if (i == 0 || run_ids_[i - 1] != run_ids_[i])
+        {
+            mesh_.vertices[welded] = block_meshes_[copy.block].vertices[copy.index];
+            mesh_.normals[welded] = block_meshes_[copy.block].normals[copy.index];
+        }
+    }
+
+    mesh_.triangles.resize(index_offsets_[num_blocks] / 3);
+    std::uint32_t* indices = mesh_.triangles.empty() ? nullptr : mesh_.triangles[0].data();
+#pragma omp parallel for
+    for (std::int64_t b = 0; b < num_blocks; b++)
+    {
+        const block_mesh& block = block_meshes_[b];
+        for (std::size_t k = 0; k < block.indices.size(); k++)
+        {
+            indices[index_offsets_[b] + k] = welded_[vertex_offsets_[b] + block.indices[k]];
+        }
+    }
+}
+
+#if !defined(XS_HEADLESS)
+draw_item fluid_surface::draw_item(rhi::device* device, rhi::buffer* d_mvp_buf, const std::size_t max_triangles)
+{
+    const render_pass& simple_pass = render_pass_registry::get().pass("simple");
+
+    // the mesh changes size every frame, so the buffers are as big as it may get and the triangles past its end are
+    // degenerate. a closed mesh has about half as many vertices as triangles
+    max_triangles_ = max_triangles;
+    drawn_triangles_ = 0;
+    d_verts_buf_ = device->create_buffer_unique(rhi::buffer_type::vertex, max_triangles * sizeof(Eigen::Vector3f), nullptr);
+    d_norms_buf_ = device->create_buffer_unique(rhi::buffer_type::vertex, max_triangles * sizeof(Eigen::Vector3f), nullptr);
+    d_inds_buf_ = device->create_buffer_unique(rhi::buffer_type::index, max_triangles * sizeof(sim::size3_t), nullptr);
+
+    d_verts_view_ = device->map_buffer<Eigen::Vector3f>(d_verts_buf_.get(), 0, max_triangles);
+    d_norms_view_ = device->map_buffer<Eigen::Vector3f>(d_norms_buf_.get(), 0, max_triangles);
+    d_inds_view_ = device->map_buffer<sim::size3_t>(d_inds_buf_.get(), 0, max_triangles);
+    std::memset(d_inds_view_.data(), 0, max_triangles * sizeof(sim::size3_t));
+
+    d_mvp_uniforms_ = simple_pass.uniform_set_builder(device, 0)
+        .uniform("ubo", { d_mvp_buf })
+        .produce();
+
+    return simple_pass.draw_item_builder()
+        .elem_count(max_triangles * 3)
+        .vertex_buffers({ d_verts_buf_.get(), d_norms_buf_.get() })
+        .index_buffer(d_inds_buf_.get())
+        .uniform_sets({ {0, d_mvp_uniforms_.get()} })
+        .update([this](rhi::device*) {
+            // extract() may be halfway through the next mesh on the sim thread
+            if (!snapshots_.fetch())
+            {
+                return;
+            }
+
+            const mesh& latest = snapshots_.front();
+            const std::size_t num_vertices = (std::min)(latest.vertices.size(), max_triangles_);
+            std::memcpy(d_verts_view_.data(), latest.vertices.data(), num_vertices * sizeof(Eigen::Vector3f));
+            std::memcpy(d_norms_view_.data(), latest.normals.data(), num_vertices * sizeof(Eigen::Vector3f));
+
+            std::size_t drawn = 0;
+            sim::size3_t* inds = d_inds_view_.data();
+            for (const sim::size3_t& triangle : latest.triangles)
+            {
+                if (drawn == max_triangles_)
+                {
+                    break;
+                }
+                if (triangle[0] < num_vertices && triangle[1] < num_vertices && triangle[2] < num_vertices)
+                {
+                    inds[drawn++] = triangle;
+                }
+            }
+            if (drawn < drawn_triangles_)
+            {
+                std::memset(inds + drawn, 0, (drawn_triangles_ - drawn) * sizeof(sim::size3_t));
+            }
+            drawn_triangles_ = drawn;
+        })
+        .produce_draw();
+}
+#endif
+
+}
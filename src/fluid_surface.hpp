@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "sim.hpp"
+
+namespace xs
+{
+
+struct fluid_surface_params
+{
+	float cell_size = 1.f; // of the marching cubes lattice, in units of h
+	float iso = .5f;
+	float surface_density = .9f; // of the rest density, a droplet squeezed above it doesn't get meshed
+};
+
+/*
+ * triangle mesh of the surface of an sph_sim, to draw the fluid with instead of a point per particle. the fluid is the
+ * sum of the particles' kernels, scaled to 1 for particles at the rest spacing, and the surface is where it drops to
+ * iso. the field only gets splatted into blocks of block_cells^3 cells around surface particles, the ones under
+ * surface_density of the rest density, so meshing costs go with the area of the surface and not the volume of the
+ * fluid. blocks get meshed in parallel with marching cubes and the vertices they share on their borders get welded
+ * by the lattice edge they're on
+ */
+class fluid_surface
+{
+public:
+	static constexpr std::uint32_t block_cells = 8;
+
+	struct mesh
+	{
+		std::vector<Eigen::Vector3f> vertices;
+		std::vector<Eigen::Vector3f> normals;
+		std::vector<sim::size3_t> triangles;
+	};
+
+	explicit fluid_surface(const fluid_surface_params& params = {});
+
+	// meshes the particles of sim as they are, on the thread stepping it
+	void extract(const sph_sim& sim);
+
+	// the last extracted mesh, triangles are counterclockwise seen from outside
+	const mesh& surface() const { return mesh_; }
+	std::size_t num_blocks() const { return blocks_.size(); }
+
+	// extract() publishes every mesh, the draw item picks up the latest one. the buffers hold up to max_triangles,
+	// anything past that gets dropped
+#if !defined(XS_HEADLESS)
+	draw_item draw_item(rhi::device* device, rhi::buffer* d_mvp_buf, const std::size_t max_triangles);
+#endif
+
+private:
+	// one block's share of the mesh, triangles index into its own vertices until they get welded
+	struct block_mesh
+	{
+		std::vector<std::uint64_t> edges; // lattice edge of every vertex
+		std::vector<Eigen::Vector3f> vertices;
+		std::vector<Eigen::Vector3f> normals;
+		std::vector<std::uint32_t> indices;
+		std::vector<std::uint32_t> particles; // the ones splatted into it, kept to reuse the allocation
+	};
+
+	// a vertex copy, index is into its block's vertices
+	struct edge_vertex
+	{
+		std::uint64_t edge;
+		std::uint32_t block;
+		std::uint32_t index;
+	};
+
+	void collect_blocks(const sph_sim& sim);
+	void mesh_block(const sph_sim& sim, const std::size_t b);
+	void weld();
+
+	fluid_surface_params params_;
+	float cell_size_;
+	float inv_cell_size_;
+	float block_size_;
+	float inv_rest_sum_;
+
+	std::vector<std::uint32_t> particle_offsets_; // count, scan, fill of the blocks around the surface particles
+	std::vector<std::uint64_t> block_keys_;
+	std::vector<std::array<std::int32_t, 3>> blocks_;
+	std::vector<block_mesh> block_meshes_;
+	std::vector<std::uint32_t> vertex_offsets_;
+	std::vector<std::uint32_t> index_offsets_;
+	std::vector<edge_vertex> edge_vertices_;
+	std::vector<std::uint32_t> run_ids_;
+	std::vector<std::uint32_t> welded_; // welded index of every copy
+
+	mesh mesh_;
+	sim::snapshot_buffer<mesh> snapshots_;
+
+#if !defined(XS_HEADLESS)
+	std::size_t max_triangles_;
+	std::size_t drawn_triangles_;
+	rhi::device::scoped_mmap<Eigen::Vector3f> d_verts_view_;
+	rhi::device::scoped_mmap<Eigen::Vector3f> d_norms_view_;
+	rhi::device::scoped_mmap<sim::size3_t> d_inds_view_;
+	rhi::device::ptr<rhi::buffer> d_verts_buf_;
+	rhi::device::ptr<rhi::buffer> d_norms_buf_;
+	rhi::device::ptr<rhi::buffer> d_inds_buf_;
+	rhi::device::ptr<rhi::uniform_set> d_mvp_uniforms_;
+#endif
+};
+
+}
@@ -0,0 +1,472 @@
+#include "particle_cache.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <execution>
+#include <stdexcept>
+
+#include "util.hpp"
+
+namespace xs
+{
+
+namespace particle_cache
+{
+    namespace
+    {
+        constexpr std::array<char, 8> file_magic = { 'x', 's', 'p', 'c', 'a', 'c', 'h', 'e' };
+        constexpr std::array<char, 8> index_magic = { 'x', 's', 'p', 'c', 'i', 'n', 'd', 'x' };
+        constexpr std::uint32_t frame_magic = checkpoint::tag("frme");
+        constexpr std::uint32_t has_velocities_flag = 1;
+        constexpr std::uint64_t frame_alignment = 8;
+
+        struct file_header
+        {
+            std::array<char, 8> magic;
+            std::uint32_t version;
+            std::uint32_t position_bits;
+            std::uint32_t flags;
+            std::uint32_t pad;
+        };
+
+        // followed by num_blocks + 1 offsets into the varint stream, the stream and then the halfs, 8 byte aligned
+        struct frame_header
+        {
+            std::uint32_t magic;
+            std::uint32_t num_particles;
+            std::uint32_t num_blocks;
+            std::uint32_t stream_size;
+            double time;
+            std::array<float, 3> low;
+            std::array<float, 3> high;
+            std::uint64_t size; // of the whole frame, header included
+        };
+
+        struct index_footer
+        {
+            std::uint64_t num_frames;
+            std::uint64_t offset;
+            std::array<char, 8> magic;
+        };
+
+        inline std::uint64_t align_up(const std::uint64_t offset)
+        {
+            return (offset + frame_alignment - 1) / frame_alignment * frame_alignment;
+        }
+
+        inline void write_varint(std::vector<std::uint8_t>& bytes, std::uint64_t v)
+        {
+            while (v >= 0x80)
+            {
+                bytes.push_back(std::uint8_t(v | 0x80));
+                v >>= 7;
+            }
+            bytes.push_back(std::uint8_t(v));
+        }
+
+        // stops at end, a truncated varint just decodes to garbage instead of reading past the block
+        inline std::uint64_t read_varint(const std::uint8_t*& it, const std::uint8_t* end)
+        {
+            std::uint64_t v = 0;
+            for (std::uint32_t shift = 0; it != end && shift < 64; shift += 7)
+            {
+                const std::uint8_t byte = *it++;
+                v |= std::uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    return v;
+                }
+            }
+            return v;
+        }
+
+        // a frame header with its whole frame inside bytes
+        inline bool frame_fits(const std::span<const std::byte> bytes, const std::uint64_t offset)
+        {
+            if (offset > bytes.size() || bytes.size() - offset < sizeof(frame_header))
+            {
+                return false;
+            }
+            frame_header frame;
+            std::memcpy(&frame, bytes.data() + offset, sizeof(frame));
+            return frame.magic == frame_magic && frame.size >= sizeof(frame_header) && frame.size <= bytes.size() - offset;
+        }
+
+        // maps quantized coords back to the frame bounds, the same step both ways so a frame round trips exactly
+        inline Eigen::Vector3f cell_step(const frame_header& header, const std::uint32_t bits)
+        {
+            const float max_q = float((1u << bits) - 1);
+            return Eigen::Vector3f(header.high[0] - header.low[0], header.high[1] - header.low[1], header.high[2] - header.low[2]) / max_q;
+        }
+    }
+
+    writer::writer(const std::string& filename, const params& params) :
+        file_(filename, std::ios::binary | std::ios::trunc),
+        params_(params),
+        frame_offsets_(),
+        offset_(0),
+        queued_(),
+        has_queued_(false),
+        stop_(false),
+        error_(),
+        mutex_(),
+        queued_cv_(),
+        taken_cv_(),
+        thread_()
+    {
+        if (!file_.is_open())
+        {
+            throw std::runtime_error("Failed to open file!");
+        }
+        params_.position_bits = std::clamp(params_.position_bits, 1u, 21u);
+
+        const file_header header = {
+            .magic = file_magic,
+            .version = version,
+            .position_bits = params_.position_bits,
+            .flags = params_.velocities ? has_velocities_flag : 0,
+            .pad = 0
+        };
+        file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        offset_ = sizeof(header);
+
+        thread_ = std::thread(&writer::worker, this);
+    }
+
+    writer::~writer()
+    {
+        try
+        {
+            close();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    void writer::write_frame(const std::span<const sim::particle> particles, const double time)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        taken_cv_.wait(lock, [this] { return !has_queued_ || error_; });
+        rethrow();
+        if (stop_)
+        {
+            throw std::runtime_error("particle cache is closed");
+        }
+
+        queued_.positions.resize(particles.size());
+        queued_.velocities.resize(params_.velocities ? particles.size() : 0);
+        for (std::size_t i = 0; i < particles.size(); i++)
+        {
+            queued_.positions[i] = particles[i].pos;
+        }
+        for (std::size_t i = 0; i < queued_.velocities.size(); i++)
+        {
+            queued_.velocities[i] = particles[i].vel;
+        }
+        queued_.time = time;
+        has_queued_ = true;
+        queued_cv_.notify_one();
+    }
+
+    void writer::close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stop_ && !thread_.joinable())
+            {
+                return;
+            }
+            stop_ = true;
+        }
+        queued_cv_.notify_one();
+        thread_.join();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        rethrow();
+
+        const index_footer footer = { .num_frames = frame_offsets_.size(), .offset = offset_, .magic = index_magic };
+        file_.write(reinterpret_cast<const char*>(frame_offsets_.data()), std::streamsize(frame_offsets_.size() * sizeof(std::uint64_t)));
+        file_.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        file_.close();
+        if (file_.fail())
+        {
+            throw std::runtime_error("Failed to write particle cache!");
+        }
+    }
+
+    void writer::rethrow()
+    {
+        if (error_)
+        {
+            std::rethrow_exception(std::exchange(error_, nullptr));
+        }
+    }
+
+    void writer::worker()
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queued_cv_.wait(lock, [this] { return has_queued_ || stop_; });
+                if (!has_queued_)
+                {
+                    return;
+                }
+
+                // the caller can queue the next frame while this one gets encoded
+                std::swap(queued_, encoding_);
+                has_queued_ = false;
+            }
+            taken_cv_.notify_one();
+
+            try
+            {
+                encode(encoding_);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                error_ = std::current_exception();
+                taken_cv_.notify_one();
+                return;
+            }
+        }
+    }
+
+    void writer::encode(const frame& f)
+    {
+        const std::uint32_t n = std::uint32_t(f.positions.size());
+        const std::uint32_t bits = params_.position_bits;
+        Eigen::Vector3f low = mth::vec3f_replicate(0.f), high = mth::vec3f_replicate(0.f);
+        if (n > 0)
+        {
+            low = f.positions[0];
+            high = f.positions[0];
+            for (const Eigen::Vector3f& p : f.positions)
+            {
+                low = low.cwiseMin(p);
+                high = high.cwiseMax(p);
+            }
+        }
+
+        frame_header header = {
+            .magic = frame_magic,
+            .num_particles = n,
+            .num_blocks = (n + particles_per_block - 1) / particles_per_block,
+            .stream_size = 0,
+            .time = f.time,
+            .low = { low.x(), low.y(), low.z() },
+            .high = { high.x(), high.y(), high.z() },
+            .size = 0
+        };
+
+        // flat axes still get a nonzero step so the division stays finite, everything quantizes to 0 on them
+        const Eigen::Vector3f step = cell_step(header, bits).cwiseMax(mth::vec3f_replicate(1e-30f));
+        const Eigen::Vector3f inv_step = step.cwiseInverse();
+        const float max_q = float((1u << bits) - 1);
+        keys_.resize(n);
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            const Eigen::Vector3f q = ((f.positions[i] - low).cwiseProduct(inv_step).array() + .5f).min(max_q).matrix();
+            keys_[i] = { sim::morton_encode(std::uint32_t(q.x()), std::uint32_t(q.y()), std::uint32_t(q.z())), std::uint32_t(i) };
+        }
+        // the sim keeps its particles close to morton order, so this is mostly sorted already
+        std::sort(std::execution::par, std::begin(keys_), std::end(keys_));
+
+        // every block starts over from 0, so blocks decode independently
+        bytes_.clear();
+        block_offsets_.clear();
+        std::uint64_t prev = 0;
+        for (std::uint32_t i = 0; i < n; i++)
+        {
+            if (i % particles_per_block == 0)
+            {
+                block_offsets_.push_back(std::uint32_t(bytes_.size()));
+                prev = 0;
+            }
+            write_varint(bytes_, keys_[i].first - prev);
+            prev = keys_[i].first;
+        }
+        block_offsets_.push_back(std::uint32_t(bytes_.size()));
+        header.stream_size = std::uint32_t(bytes_.size());
+
+        halfs_.resize(f.velocities.size() * 3);
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < std::int64_t(f.velocities.size()); i++)
+        {
+            const Eigen::Vector3f& v = f.velocities[keys_[i].second];
+            for (std::size_t axis = 0; axis < 3; axis++)
+            {
+                halfs_[i * 3 + axis] = util::float_to_half_fast3_rtne(v[axis]).u;
+            }
+        }
+
+        const std::uint64_t offsets_size = block_offsets_.size() * sizeof(std::uint32_t);
+        const std::uint64_t halfs_offset = align_up(sizeof(frame_header) + offsets_size + bytes_.size());
+        header.size = align_up(halfs_offset + halfs_.size() * sizeof(std::uint16_t));
+
+        static constexpr std::array<char, frame_alignment> padding = {};
+        file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file_.write(reinterpret_cast<const char*>(block_offsets_.data()), std::streamsize(offsets_size));
+        file_.write(reinterpret_cast<const char*>(bytes_.data()), std::streamsize(bytes_.size()));
+        file_.write(padding.data(), std::streamsize(halfs_offset - (sizeof(frame_header) + offsets_size + bytes_.size())));
+        file_.write(reinterpret_cast<const char*>(halfs_.data()), std::streamsize(halfs_.size() * sizeof(std::uint16_t)));
+        file_.write(padding.data(), std::streamsize(header.size - (halfs_offset + halfs_.size() * sizeof(std::uint16_t))));
+        if (!file_.good())
+        {
+            throw std::runtime_error("Failed to write particle cache!");
+        }
+
+        frame_offsets_.push_back(offset_);
+        offset_ += header.size;
+    }
+
+    reader::reader(const std::string& filename) :
+        file_(filename),
+        position_bits_(0),
+        has_velocities_(false),
+        frames_()
+    {
+        const std::span<const std::byte> bytes = file_.bytes();
+        file_header header;
+        if (bytes.size() < sizeof(header))
+        {
+            throw std::runtime_error("not a particle cache");
+        }
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (header.magic != file_magic)
+        {
+            throw std::runtime_error("not a particle cache");
+        }
+        if (header.version != version)
+        {
+            throw std::runtime_error("particle cache version mismatch");
+        }
+        position_bits_ = header.position_bits;
+        has_velocities_ = header.flags & has_velocities_flag;
+
+        index_footer footer = {};
+        if (bytes.size() >= sizeof(header) + sizeof(footer))
+        {
+            std::memcpy(&footer, bytes.data() + bytes.size() - sizeof(footer), sizeof(footer));
+        }
+        // written that way round so a garbage offset or count can't wrap
+        const std::uint64_t index_end = bytes.size() - sizeof(footer);
+        if (footer.magic == index_magic && footer.offset >= sizeof(header) && footer.offset <= index_end
+            && footer.num_frames == (index_end - footer.offset) / sizeof(std::uint64_t) && (index_end - footer.offset) % sizeof(std::uint64_t) == 0)
+        {
+            frames_.resize(footer.num_frames);
+            std::memcpy(frames_.data(), bytes.data() + footer.offset, frames_.size() * sizeof(std::uint64_t));
+            for (const std::uint64_t offset : frames_)
+            {
+                if (offset < sizeof(header) || offset % frame_alignment != 0 || !frame_fits(bytes, offset))
+                {
+                    throw std::runtime_error("particle cache index is corrupt");
+                }
+            }
+            return;
+        }
+
+        // no index, keep every frame that made it to disk completely
+        std::uint64_t offset = sizeof(header);
+        while (frame_fits(bytes, offset))
+        {
+            frame_header frame;
+            std::memcpy(&frame, bytes.data() + offset, sizeof(frame));
+            frames_.push_back(offset);
+            offset += frame.size;
+        }
+    }
+
+    const std::byte* reader::frame_bytes(const std::size_t frame) const
+    {
+        if (frame >= frames_.size())
+        {
+            throw std::out_of_range("particle cache frame out of range");
+        }
+        return file_.bytes().data() + frames_[frame];
+    }
+
+    std::uint32_t reader::frame_size(const std::size_t frame) const
+    {
+        frame_header header;
+        std::memcpy(&header, frame_bytes(frame), sizeof(header));
+        return header.num_particles;
+    }
+
+    double reader::frame_time(const std::size_t frame) const
+    {
+        frame_header header;
+        std::memcpy(&header, frame_bytes(frame), sizeof(header));
+        return header.time;
+    }
+
+    void reader::decode(const std::size_t frame, const std::span<Eigen::Vector3f> positions, const std::span<Eigen::Vector3f> velocities) const
+    {
+        const std::byte* begin = frame_bytes(frame);
+        frame_header header;
+        std::memcpy(&header, begin, sizeof(header));
+        if (positions.size() < header.num_particles || (!velocities.empty() && velocities.size() < header.num_particles))
+        {
+            throw std::runtime_error("particle cache frame doesn't fit");
+        }
+
+        // everything below is sized from the header, so check it all lands inside the frame first (all in 64 bits, none of it can wrap)
+        const std::uint64_t stream_offset = sizeof(header) + (std::uint64_t(header.num_blocks) + 1) * sizeof(std::uint32_t);
+        const std::uint64_t halfs_offset = align_up(stream_offset + header.stream_size);
+        const std::uint64_t halfs_size = has_velocities_ ? std::uint64_t(header.num_particles) * 3 * sizeof(std::uint16_t) : 0;
+        if (header.num_blocks != (std::uint64_t(header.num_particles) + particles_per_block - 1) / particles_per_block
+            || halfs_offset + halfs_size > header.size)
+        {
+            throw std::runtime_error("particle cache frame is corrupt");
+        }
+
+        // frames are 8 byte aligned in the mapping, so the offsets and halfs can be read in place
+        const std::uint32_t* block_offsets = reinterpret_cast<const std::uint32_t*>(begin + sizeof(header));
+        const std::uint8_t* stream = reinterpret_cast<const std::uint8_t*>(begin + stream_offset);
+        const std::uint16_t* halfs = reinterpret_cast<const std::uint16_t*>(begin + halfs_offset);
+        for (std::uint32_t b = 0; b < header.num_blocks; b++)
+        {
+            if (block_offsets[b] > block_offsets[b + 1])
+            {
+                throw std::runtime_error("particle cache frame is corrupt");
+            }
+        }
+        if (block_offsets[header.num_blocks] != header.stream_size)
+        {
+            throw std::runtime_error("particle cache frame is corrupt");
+        }
+
+        const Eigen::Vector3f low = Eigen::Vector3f(header.low[0], header.low[1], header.low[2]);
+        const Eigen::Vector3f step = cell_step(header, position_bits_);
+        const bool decode_velocities = has_velocities_ && !velocities.empty();
+        const std::int64_t num_blocks = header.num_blocks;
+#pragma omp parallel for
+        for (std::int64_t b = 0; b < num_blocks; b++)
+        {
+            const std::uint8_t* it = stream + block_offsets[b];
+            const std::uint8_t* end = stream + block_offsets[b + 1];
+            const std::uint32_t first = std::uint32_t(b) * particles_per_block;
+            const std::uint32_t last = (std::min)(first + particles_per_block, header.num_particles);
+            std::uint64_t code = 0;
+            for (std::uint32_t i = first; i < last; i++)
+            {
+                code += read_varint(it, end);
+                const sim::size3_t q = sim::morton_decode(code);
+                positions[i] = low + step.cwiseProduct(Eigen::Vector3f(float(q[0]), float(q[1]), float(q[2])));
+                if (decode_velocities)
+                {
+                    velocities[i] = Eigen::Vector3f(util::half_to_float({ halfs[i * 3] }).f,
+                        util::half_to_float({ halfs[i * 3 + 1] }).f, util::half_to_float({ halfs[i * 3 + 2] }).f);
+                }
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "sim.hpp"
+
+namespace xs
+{
+
+/*
+ * particle caches hold one frame after the other, so they can be written while a shot is simulating and played
+ * back without the sim. positions are quantized to position_bits per axis against the bounds of their frame, sorted
+ * by the morton code of the quantized position and stored as varint deltas between neighboring codes, which comes to
+ * 3-4 bytes per particle for a dense fluid at the default 14 bits instead of 12. velocities are optional and stored
+ * as halfs. particles come out of a frame in morton order, not in the order they went in, so there's no identity
+ * across frames.
+ *
+ * an index of the frames goes at the end of the file when the writer is closed, without it (the writer crashed)
+ * the reader walks the frames from the front and stops at the first incomplete one
+ */
+namespace particle_cache
+{
+	static constexpr std::uint32_t version = 1;
+	static constexpr std::uint32_t particles_per_block = 4096; // frames decode a block per thread
+
+	struct params
+	{
+		std::uint32_t position_bits = 14; // per axis, up to 21
+		bool velocities = true;
+	};
+
+	class writer
+	{
+	public:
+		// throws std::runtime_error if the file can't be created
+		writer(const std::string& filename, const params& params = {});
+		// closes the cache, errors left by the writer thread are dropped, call close() to see them
+		~writer();
+
+		writer(const writer&) = delete;
+		writer& operator=(const writer&) = delete;
+
+		// copies the particles and returns while the writer thread encodes and writes them, so the next step can run
+		// meanwhile. only waits when the previous frame is still queued. throws what the writer thread ran into
+		void write_frame(const std::span<const sim::particle> particles, const double time);
+
+		// writes the last frame and the index
+		void close();
+
+	private:
+		struct frame
+		{
+			std::vector<Eigen::Vector3f> positions;
+			std::vector<Eigen::Vector3f> velocities;
+			double time = 0.;
+		};
+
+		void worker();
+		void encode(const frame& f);
+		void rethrow();
+
+		std::ofstream file_;
+		params params_;
+		std::vector<std::uint64_t> frame_offsets_;
+		std::uint64_t offset_;
+
+		frame queued_;
+		bool has_queued_;
+		bool stop_;
+		std::exception_ptr error_;
+		std::mutex mutex_;
+		std::condition_variable queued_cv_;
+		std::condition_variable taken_cv_;
+		std::thread thread_;
+
+		// writer thread only
+		frame encoding_;
+		std::vector<std::pair<std::uint64_t, std::uint32_t>> keys_;
+		std::vector<std::uint8_t> bytes_;
+		std::vector<std::uint32_t> block_offsets_;
+		std::vector<std::uint16_t> halfs_;
+	};
+
+	class reader
+	{
+	public:
+		// maps the file, throws std::runtime_error if it isn't a particle cache of this version
+		explicit reader(const std::string& filename);
+
+		inline std::size_t num_frames() const { return frames_.size(); }
+		inline bool has_velocities() const { return has_velocities_; }
+
+		// these throw std::out_of_range for frame >= num_frames()
+		std::uint32_t frame_size(const std::size_t frame) const;
+		double frame_time(const std::size_t frame) const;
+
+		// decodes frame straight into positions (and velocities if given), which need room for frame_size(frame)
+		// elements. they can point into a mapped vertex buffer
+		void decode(const std::size_t frame, const std::span<Eigen::Vector3f> positions, const std::span<Eigen::Vector3f> velocities = {}) const;
+
+	private:
+		const std::byte* frame_bytes(const std::size_t frame) const;
+
+		mapped_file file_;
+		std::uint32_t position_bits_;
+		bool has_velocities_;
+		std::vector<std::uint64_t> frames_; // offsets of the frame headers
+	};
+}
+
+}
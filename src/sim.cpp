@@ -1,26 +1,66 @@
 #include "sim.hpp"
+#include "checkpoint.hpp"
 
+#include <bit>
 #include <cassert>
+#include <cstring>
 #include <algorithm>
 #include <execution>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <chrono>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if !defined(_MSC_VER)
+#define __debugbreak() __builtin_trap()
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
 
 namespace xs
 {
 
 cloth::cloth(const sim::size2_t& resolution, const Eigen::Vector3f& low, const Eigen::Vector3f& high, const std::vector<sim::size2_t>& fixed_verts) :
-    forces_(resolution[0] * resolution[1], Eigen::Vector3f(0.f, 0.f, 0.f)),
+    forces_(),
     spring_dampers_(),
-    velocities_(resolution[0] * resolution[1], Eigen::Vector3f(0.f, 0.f, 0.f)),
-    verts_(resolution[0] * resolution[1]),
+    spring_order_(),
+    spring_colors_(),
+    bending_(),
+    bending_order_(),
+    bending_colors_(),
+    velocities_(),
+    verts_(),
     tri_norms_(),
     norms_(resolution[0] * resolution[1], Eigen::Vector3f(0.f, 0.f, 1.f)),
     inds_(),
+    vertex_triangle_offsets_(),
+    vertex_triangles_(),
+    tri_forces_(),
+    vertex_spring_offsets_(),
+    vertex_springs_(),
+    spring_forces_(),
     fixed_(),
-    d_vert_pos_view_(),
-    d_vert_norm_view_(),
-    d_vert_pos_buf_(),
-    d_vert_norm_buf_(),
-    d_inds_buf_(),
+    inv_masses_(),
+    integrator_(sim::cloth_integrator::symplectic_euler),
+    implicit_params_(),
+    xpbd_params_(),
+    system_(),
+    spring_slots_(),
+    inv_diagonal_(),
+    rhs_(),
+    dv_(),
+    residual_(),
+    direction_(),
+    preconditioned_(),
+    product_(),
+    predicted_(),
+    lambdas_(),
     v_wind_(Eigen::Vector3f(0.f, 0.f, 0.f)),
     k_spring_(1000.f),
     k_damping_(1.f)
@@ -30,13 +70,16 @@ cloth::cloth(const sim::size2_t& resolution, const Eigen::Vector3f& low, const E
 
     const std::size_t n = resolution[0];
     const Eigen::Vector3f diff = (high - low) / float(n - 1);
+    forces_.resize(resolution[0] * resolution[1], mth::vec3f_zeros());
+    velocities_.resize(resolution[0] * resolution[1], mth::vec3f_zeros());
+    verts_.resize(resolution[0] * resolution[1], mth::vec3f_zeros());
     for (std::size_t y = 0; y < resolution[1]; y++)
     {
         for (std::size_t x = 0; x < resolution[0]; x++)
         {
             const std::size_t i = y * n + x;
             const Eigen::Vector3f v = low + diff.cwiseProduct(Eigen::Vector3f(float(x), float(y), 0.f));
-            verts_[i] = v;
+            verts_.set(i, v);
         }
     }
 
@@ -55,8 +98,8 @@ cloth::cloth(const sim::size2_t& resolution, const Eigen::Vector3f& low, const E
             inds_.push_back({ std::uint32_t(i00), std::uint32_t(i10), std::uint32_t(i11) });
             inds_.push_back({ std::uint32_t(i00), std::uint32_t(i11), std::uint32_t(i01) });
 
-            const float l0 = (verts_[i00] - verts_[i10]).norm(), l1 = (verts_[i00] - verts_[i11]).norm(),
-                l2 = (verts_[i10] - verts_[i01]).norm(), l3 = (verts_[i00] - verts_[i01]).norm();
+            const float l0 = (verts_.get(i00) - verts_.get(i10)).norm(), l1 = (verts_.get(i00) - verts_.get(i11)).norm(),
+                l2 = (verts_.get(i10) - verts_.get(i01)).norm(), l3 = (verts_.get(i00) - verts_.get(i01)).norm();
             spring_dampers_.push_back({ .i0 = i00, .i1 = i10, .dist = l0 });
             spring_dampers_.push_back({ .i0 = i00, .i1 = i11, .dist = l1 });
             spring_dampers_.push_back({ .i0 = i10, .i1 = i01, .dist = l2 });
@@ -68,7 +111,7 @@ cloth::cloth(const sim::size2_t& resolution, const Eigen::Vector3f& low, const E
     {
         const sim::size2_t i0 = { resolution[0] - 1, y }, i1 = { resolution[0] - 1, y + 1 };
         const std::size_t d0 = i0[1] * n + i0[0], d1 = i1[1] * n + i1[0];
-        const float l = (verts_[d0] - verts_[d1]).norm();
+        const float l = (verts_.get(d0) - verts_.get(d1)).norm();
         spring_dampers_.push_back({ .i0 = d0, .i1 = d1, .dist = l });
     }
 
@@ -76,50 +119,519 @@ cloth::cloth(const sim::size2_t& resolution, const Eigen::Vector3f& low, const E
     {
         const sim::size2_t i0 = { resolution[0] - x - 2, resolution[1] - 1 }, i1 = { resolution[0] - x - 1, resolution[1] - 1 };
         const std::size_t d0 = i0[1] * n + i0[0], d1 = i1[1] * n + i1[0];
-        const float l = (verts_[d0] - verts_[d1]).norm();
+        const float l = (verts_.get(d0) - verts_.get(d1)).norm();
         spring_dampers_.push_back({ .i0 = d0, .i1 = d1, .dist = l });
     }    
 
-    velocities_ = std::vector<Eigen::Vector3f>(verts_.size(), mth::vec3f_zeros());
-
     std::sort(std::begin(inds_), std::end(inds_), [](const sim::size3_t& t0, const sim::size3_t& t1) { return t0[0] < t1[0]; });
     std::sort(std::begin(spring_dampers_), std::end(spring_dampers_), 
         [](const spring_damper& sd0, const spring_damper& sd1) { return sd0.i0 < sd1.i0; }
     );
+    build_bending_constraints();
+    build_vertex_triangles();
+    build_vertex_springs();
+    color_constraints(spring_dampers_, spring_order_, spring_colors_);
+    color_constraints(bending_, bending_order_, bending_colors_);
 
     for (const sim::size2_t& i : fixed_verts)
     {
         fixed_.push_back(i[1] * n + i[0]);
     }
+    update_inv_masses();
 }
 
-void cloth::update(float dt)
+void cloth::color_constraints(const std::vector<spring_damper>& constraints, std::vector<std::uint32_t>& order, std::vector<std::size_t>& batches) const
+{
+    // greedy, every constraint takes the lowest color neither of its verts has yet. a grid vertex has at most 8
+    // springs or bending constraints so it stays well under 32 colors
+    std::vector<std::uint32_t> used(verts_.size(), 0);
+    std::vector<std::uint8_t> colors(constraints.size());
+    std::uint32_t num_colors = 0;
+    for (std::size_t i = 0; i < constraints.size(); i++)
+    {
+        const std::size_t i0 = constraints[i].i0, i1 = constraints[i].i1;
+        const std::uint32_t color = std::uint32_t(std::countr_one(used[i0] | used[i1]));
+        assert(color < 32);
+        used[i0] |= 1u << color;
+        used[i1] |= 1u << color;
+        colors[i] = std::uint8_t(color);
+        num_colors = (std::max)(num_colors, color + 1);
+    }
+
+    // stable counting sort, constraints keep their order within a batch
+    batches.assign(num_colors + 1, 0);
+    for (const std::uint8_t color : colors)
+    {
+        batches[color + 1]++;
+    }
+    std::inclusive_scan(std::begin(batches), std::end(batches), std::begin(batches));
+
+    std::vector<std::size_t> next(std::begin(batches), std::end(batches) - 1);
+    order.resize(constraints.size());
+    for (std::size_t i = 0; i < constraints.size(); i++)
+    {
+        order[next[colors[i]]++] = std::uint32_t(i);
+    }
+}
+
+void cloth::build_bending_constraints()
+{
+    // a distance constraint between the verts opposite every edge two triangles share keeps the cloth from folding
+    // along it, without any angles to differentiate
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> edges; // edge with the lower vertex on top, opposite vertex
+    edges.reserve(inds_.size() * 3);
+    for (const sim::size3_t& t : inds_)
+    {
+        for (std::size_t k = 0; k < 3; k++)
+        {
+            const std::uint64_t a = t[k], b = t[(k + 1) % 3];
+            edges.push_back({ ((std::min)(a, b) << 32) | (std::max)(a, b), t[(k + 2) % 3] });
+        }
+    }
+    std::sort(std::begin(edges), std::end(edges));
+
+    bending_.clear();
+    for (std::size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        if (edges[i].first == edges[i + 1].first)
+        {
+            const std::size_t i0 = edges[i].second, i1 = edges[i + 1].second;
+            bending_.push_back({ .i0 = i0, .i1 = i1, .dist = (verts_.get(i0) - verts_.get(i1)).norm() });
+            i++;
+        }
+    }
+}
+
+namespace
+{
+    constexpr float cloth_vertex_mass = .02f;
+
+    // blocks of the spring force derivatives, the stiffness one leaves out the transverse part of compressed springs
+    // so the system stays positive definite
+    inline Eigen::Matrix3f spring_stiffness(const Eigen::Vector3f& e, const float l, const float rest, const float k)
+    {
+        const Eigen::Matrix3f ee = e * e.transpose();
+        return k * (ee + (std::max)(0.f, 1.f - rest / l) * (Eigen::Matrix3f::Identity() - ee));
+    }
+}
+
+void cloth::build_implicit_pattern()
 {
-    static constexpr float mass = .02f;
-    static constexpr float inv_mass = 1.f / mass;
-    for (Eigen::Vector3f& f : forces_)
+    // every vertex couples to itself and to the other end of each of its springs
+    const std::size_t n = verts_.size();
+    std::vector<std::vector<std::uint32_t>> rows(n);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        rows[i].push_back(std::uint32_t(i));
+    }
+    for (const spring_damper& sd : spring_dampers_)
     {
-        f += Eigen::Vector3f(0.f, 9.81f, 0.f) * mass;
+        rows[sd.i0].push_back(std::uint32_t(sd.i1));
+        rows[sd.i1].push_back(std::uint32_t(sd.i0));
     }
 
+    system_.row_offsets.assign(n + 1, 0);
+    system_.columns.clear();
+    system_.diagonal.resize(n);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        std::sort(std::begin(rows[i]), std::end(rows[i]));
+        rows[i].erase(std::unique(std::begin(rows[i]), std::end(rows[i])), std::end(rows[i]));
+        system_.row_offsets[i] = std::uint32_t(system_.columns.size());
+        system_.columns.insert(std::end(system_.columns), std::begin(rows[i]), std::end(rows[i]));
+        system_.diagonal[i] = system_.row_offsets[i] + std::uint32_t(std::lower_bound(std::begin(rows[i]), std::end(rows[i]), std::uint32_t(i)) - std::begin(rows[i]));
+    }
+    system_.row_offsets[n] = std::uint32_t(system_.columns.size());
+    system_.blocks.resize(system_.columns.size());
+
+    const auto slot = [this](const std::size_t row, const std::size_t column) {
+        const auto begin = std::begin(system_.columns) + system_.row_offsets[row], end = std::begin(system_.columns) + system_.row_offsets[row + 1];
+        return std::uint32_t(std::lower_bound(begin, end, std::uint32_t(column)) - std::begin(system_.columns));
+    };
+    spring_slots_.resize(spring_dampers_.size());
     for (std::size_t i = 0; i < spring_dampers_.size(); i++)
     {
-        const std::size_t i0 = spring_dampers_[i].i0, i1 = spring_dampers_[i].i1;
-        const Eigen::Vector3f diff = verts_[i1] - verts_[i0];
+        spring_slots_[i] = { slot(spring_dampers_[i].i0, spring_dampers_[i].i1), slot(spring_dampers_[i].i1, spring_dampers_[i].i0) };
+    }
+
+    inv_diagonal_.resize(n);
+    rhs_.resize(n);
+    dv_.resize(n, mth::vec3f_zeros());
+    residual_.resize(n);
+    direction_.resize(n);
+    preconditioned_.resize(n);
+    product_.resize(n);
+}
+
+void cloth::assemble_implicit(const float dt)
+{
+    // (M - dt df/dv - dt^2 df/dx) dv = dt (f + dt df/dx v). every spring adds its block to the diagonal of both ends
+    // and takes it off the two blocks between them, the forces go into forces_ like the explicit springs
+    const std::int64_t n = verts_.size();
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        for (std::uint32_t b = system_.row_offsets[i]; b < system_.row_offsets[i + 1]; b++)
+        {
+            system_.blocks[b].setZero();
+        }
+        system_.blocks[system_.diagonal[i]] = Eigen::Matrix3f::Identity() * cloth_vertex_mass;
+        rhs_[i] = mth::vec3f_zeros();
+    }
+
+    const float dt2 = dt * dt;
+    for (std::size_t c = 0; c + 1 < spring_colors_.size(); c++)
+    {
+        const std::int64_t begin = spring_colors_[c], end = spring_colors_[c + 1];
+#pragma omp parallel for
+        for (std::int64_t k = begin; k < end; k++)
+        {
+            const std::uint32_t i = spring_order_[k];
+            const std::size_t i0 = spring_dampers_[i].i0, i1 = spring_dampers_[i].i1;
+            const Eigen::Vector3f diff = verts_.get(i1) - verts_.get(i0);
+            const float l = diff.norm();
+            const Eigen::Vector3f e = diff / l;
+            const float v_close = (velocities_.get(i0) - velocities_.get(i1)).dot(e);
+            const float f = -(spring_dampers_[i].dist - l) * k_spring_ - v_close * k_damping_;
+            const Eigen::Vector3f f_0 = e * f;
+            forces_.add(i0, f_0);
+            forces_.add(i1, -f_0);
+
+            const Eigen::Matrix3f stiffness = spring_stiffness(e, l, spring_dampers_[i].dist, k_spring_);
+            const Eigen::Matrix3f block = stiffness * dt2 + (e * e.transpose()) * (k_damping_ * dt);
+            system_.blocks[system_.diagonal[i0]] += block;
+            system_.blocks[system_.diagonal[i1]] += block;
+            system_.blocks[spring_slots_[i][0]] -= block;
+            system_.blocks[spring_slots_[i][1]] -= block;
+
+            const Eigen::Vector3f dv_force = stiffness * (velocities_.get(i1) - velocities_.get(i0)) * dt;
+            rhs_[i0] += dv_force;
+            rhs_[i1] -= dv_force;
+        }
+    }
+}
+
+void cloth::solve_implicit()
+{
+    const std::int64_t n = verts_.size();
+    const auto multiply = [this, n](const std::vector<Eigen::Vector3f>& x, std::vector<Eigen::Vector3f>& y) {
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            Eigen::Vector3f sum = mth::vec3f_zeros();
+            for (std::uint32_t b = system_.row_offsets[i]; b < system_.row_offsets[i + 1]; b++)
+            {
+                sum += system_.blocks[b] * x[system_.columns[b]];
+            }
+            y[i] = inv_masses_[i] == 0.f ? mth::vec3f_zeros() : sum;
+        }
+    };
+    const auto dot = [n](const std::vector<Eigen::Vector3f>& a, const std::vector<Eigen::Vector3f>& b) {
+        double sum = 0.;
+#pragma omp parallel for reduction(+:sum)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            sum += double(a[i].dot(b[i]));
+        }
+        return sum;
+    };
+
+    // block jacobi, the diagonal blocks are mass plus spd spring blocks so they always invert. the velocity change
+    // of the last step is a good first guess, stiff cloth takes several times the iterations from zero
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        inv_diagonal_[i] = system_.blocks[system_.diagonal[i]].inverse();
+        if (inv_masses_[i] == 0.f)
+        {
+            dv_[i] = mth::vec3f_zeros();
+            rhs_[i] = mth::vec3f_zeros();
+        }
+    }
+    multiply(dv_, product_);
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        residual_[i] = rhs_[i] - product_[i];
+        preconditioned_[i] = inv_diagonal_[i] * residual_[i];
+        direction_[i] = preconditioned_[i];
+    }
+
+    const double target = double(implicit_params_.tolerance) * double(implicit_params_.tolerance) * dot(rhs_, rhs_);
+    double rz = dot(residual_, preconditioned_);
+    for (std::uint32_t iteration = 0; iteration < implicit_params_.max_iterations; iteration++)
+    {
+        if (dot(residual_, residual_) <= target)
+        {
+            break;
+        }
+
+        multiply(direction_, product_);
+        const double pq = dot(direction_, product_);
+        if (pq <= 0.)
+        {
+            break;
+        }
+
+        const float alpha = float(rz / pq);
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            dv_[i] += direction_[i] * alpha;
+            residual_[i] -= product_[i] * alpha;
+            preconditioned_[i] = inv_diagonal_[i] * residual_[i];
+        }
+
+        const double rz_next = dot(residual_, preconditioned_);
+        const float beta = float(rz_next / rz);
+        rz = rz_next;
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            direction_[i] = preconditioned_[i] + direction_[i] * beta;
+        }
+    }
+}
+
+void cloth::solve_xpbd(const float dt)
+{
+    const std::int64_t n = verts_.size();
+    const float h = dt / float((std::max)(xpbd_params_.substeps, 1u));
+    const float inv_h = 1.f / h;
+    predicted_.resize(n);
+    lambdas_.resize(spring_dampers_.size() + bending_.size());
+
+    // gauss-seidel within a batch is jacobi, nothing in it shares a vertex, so the batches run in parallel and come
+    // out the same at any thread count
+    const auto project = [&](const std::vector<spring_damper>& constraints, const std::vector<std::uint32_t>& order, const std::vector<std::size_t>& batches,
+        const float compliance, float* lambdas) {
+        const float alpha = compliance * inv_h * inv_h;
+        for (std::size_t c = 0; c + 1 < batches.size(); c++)
+        {
+            const std::int64_t begin = batches[c], end = batches[c + 1];
+#pragma omp parallel for
+            for (std::int64_t k = begin; k < end; k++)
+            {
+                const std::uint32_t i = order[k];
+                const std::size_t i0 = constraints[i].i0, i1 = constraints[i].i1;
+                const float w0 = inv_masses_[i0], w1 = inv_masses_[i1];
+                const Eigen::Vector3f diff = predicted_[i1] - predicted_[i0];
+                const float l = diff.norm();
+                if (w0 + w1 + alpha <= 0.f || l <= 0.f)
+                {
+                    continue;
+                }
+
+                const Eigen::Vector3f e = diff / l;
+                const float d_lambda = (constraints[i].dist - l - alpha * lambdas[i]) / (w0 + w1 + alpha);
+                lambdas[i] += d_lambda;
+                predicted_[i0] -= e * (w0 * d_lambda);
+                predicted_[i1] += e * (w1 * d_lambda);
+            }
+        }
+    };
+
+    for (std::uint32_t substep = 0; substep < xpbd_params_.substeps; substep++)
+    {
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            // fixed verts have no inverse mass, so they keep their zero velocity and stay put
+            velocities_.add(i, forces_.get(i) * h * inv_masses_[i]);
+            predicted_[i] = verts_.get(i) + velocities_.get(i) * h;
+        }
+
+        std::fill(std::begin(lambdas_), std::end(lambdas_), 0.f);
+        for (std::uint32_t iteration = 0; iteration < xpbd_params_.iterations; iteration++)
+        {
+            project(spring_dampers_, spring_order_, spring_colors_, xpbd_params_.stretch_compliance, lambdas_.data());
+            if (xpbd_params_.bending)
+            {
+                project(bending_, bending_order_, bending_colors_, xpbd_params_.bending_compliance, lambdas_.data() + spring_dampers_.size());
+            }
+        }
+
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            velocities_.set(i, (predicted_[i] - verts_.get(i)) * inv_h);
+            verts_.set(i, predicted_[i]);
+        }
+    }
+}
+
+void cloth::build_vertex_triangles()
+{
+    const std::size_t n = verts_.size();
+    vertex_triangle_offsets_.assign(n + 1, 0);
+    for (const sim::size3_t& tri : inds_)
+    {
+        for (const std::uint32_t i : tri)
+        {
+            vertex_triangle_offsets_[i + 1]++;
+        }
+    }
+    std::inclusive_scan(std::begin(vertex_triangle_offsets_), std::end(vertex_triangle_offsets_), std::begin(vertex_triangle_offsets_));
+
+    // filling in triangle order leaves every vertex's triangles ascending
+    std::vector<std::uint32_t> fill(std::begin(vertex_triangle_offsets_), std::end(vertex_triangle_offsets_) - 1);
+    vertex_triangles_.resize(vertex_triangle_offsets_.back());
+    for (std::size_t t = 0; t < inds_.size(); t++)
+    {
+        for (const std::uint32_t i : inds_[t])
+        {
+            vertex_triangles_[fill[i]++] = std::uint32_t(t);
+        }
+    }
+    tri_forces_.resize(inds_.size());
+}
+
+void cloth::build_vertex_springs()
+{
+    const std::size_t n = verts_.size();
+    vertex_spring_offsets_.assign(n + 1, 0);
+    for (const spring_damper& sd : spring_dampers_)
+    {
+        vertex_spring_offsets_[sd.i0 + 1]++;
+        vertex_spring_offsets_[sd.i1 + 1]++;
+    }
+    std::inclusive_scan(std::begin(vertex_spring_offsets_), std::end(vertex_spring_offsets_), std::begin(vertex_spring_offsets_));
+
+    std::vector<std::uint32_t> fill(std::begin(vertex_spring_offsets_), std::end(vertex_spring_offsets_) - 1);
+    vertex_springs_.resize(vertex_spring_offsets_.back());
+    for (std::size_t s = 0; s < spring_dampers_.size(); s++)
+    {
+        vertex_springs_[fill[spring_dampers_[s].i0]++] = std::uint32_t(s * 2);
+        vertex_springs_[fill[spring_dampers_[s].i1]++] = std::uint32_t(s * 2 + 1);
+    }
+    spring_forces_.resize(spring_dampers_.size());
+}
+
+void cloth::update_inv_masses()
+{
+    inv_masses_.assign(verts_.size(), 1.f / cloth_vertex_mass);
+    for (const std::size_t i : fixed_)
+    {
+        inv_masses_[i] = 0.f;
+    }
+}
+
+void cloth::integrate_vertices(const float dt, const bool apply_forces, const bool move)
+{
+    // fixed verts have no inverse mass so they never pick up a velocity and moving them adds 0. whatever is above
+    // the ground plane gets bounced with friction by the forces of the next step, the rest starts from 0
+    static constexpr float ground = 20.1f;
+    static constexpr float ep = .05f;
+    static constexpr float mu_static = .75f;
+    static constexpr float bounce = -(1.f + ep);
+    const std::int64_t n = verts_.size();
+    float* x = verts_.x.data(), * y = verts_.y.data(), * z = verts_.z.data();
+    float* vx = velocities_.x.data(), * vy = velocities_.y.data(), * vz = velocities_.z.data();
+    float* fx = forces_.x.data(), * fy = forces_.y.data(), * fz = forces_.z.data();
+    const float* inv_masses = inv_masses_.data();
+
+    std::int64_t simd_end = 0;
+#if defined(__AVX2__)
+    simd_end = n / 8 * 8;
+    const __m256 dt8 = _mm256_set1_ps(dt);
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < simd_end; i += 8)
+    {
+        __m256 vx8 = _mm256_load_ps(vx + i), vy8 = _mm256_load_ps(vy + i), vz8 = _mm256_load_ps(vz + i);
+        if (apply_forces)
+        {
+            const __m256 w = _mm256_load_ps(inv_masses + i);
+            vx8 = _mm256_add_ps(vx8, _mm256_mul_ps(_mm256_mul_ps(_mm256_load_ps(fx + i), dt8), w));
+            vy8 = _mm256_add_ps(vy8, _mm256_mul_ps(_mm256_mul_ps(_mm256_load_ps(fy + i), dt8), w));
+            vz8 = _mm256_add_ps(vz8, _mm256_mul_ps(_mm256_mul_ps(_mm256_load_ps(fz + i), dt8), w));
+            _mm256_store_ps(vx + i, vx8);
+            _mm256_store_ps(vy + i, vy8);
+            _mm256_store_ps(vz + i, vz8);
+        }
+
+        __m256 y8 = _mm256_load_ps(y + i);
+        if (move)
+        {
+            y8 = _mm256_add_ps(y8, _mm256_mul_ps(vy8, dt8));
+            _mm256_store_ps(x + i, _mm256_add_ps(_mm256_load_ps(x + i), _mm256_mul_ps(vx8, dt8)));
+            _mm256_store_ps(y + i, y8);
+            _mm256_store_ps(z + i, _mm256_add_ps(_mm256_load_ps(z + i), _mm256_mul_ps(vz8, dt8)));
+        }
+
+        const __m256 grounded = _mm256_cmp_ps(y8, _mm256_set1_ps(ground), _CMP_GT_OQ);
+        const __m256 jy = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(bounce), vy8), _mm256_set1_ps(cloth_vertex_mass));
+        const __m256 neg_mu = _mm256_set1_ps(-mu_static);
+        _mm256_store_ps(fx + i, _mm256_and_ps(grounded, _mm256_mul_ps(vx8, neg_mu)));
+        _mm256_store_ps(fy + i, _mm256_and_ps(grounded, _mm256_sub_ps(_mm256_div_ps(jy, dt8), _mm256_set1_ps(9.81f))));
+        _mm256_store_ps(fz + i, _mm256_and_ps(grounded, _mm256_mul_ps(vz8, neg_mu)));
+    }
+#endif
+
+#pragma omp parallel for
+    for (std::int64_t i = simd_end; i < n; i++)
+    {
+        if (apply_forces)
+        {
+            vx[i] += fx[i] * dt * inv_masses[i];
+            vy[i] += fy[i] * dt * inv_masses[i];
+            vz[i] += fz[i] * dt * inv_masses[i];
+        }
+        if (move)
+        {
+            x[i] += vx[i] * dt;
+            y[i] += vy[i] * dt;
+            z[i] += vz[i] * dt;
+        }
+
+        const bool grounded = y[i] > ground;
+        const float jy = bounce * vy[i] * cloth_vertex_mass;
+        fx[i] = grounded ? vx[i] * -mu_static : 0.f;
+        fy[i] = grounded ? jy / dt - 9.81f : 0.f;
+        fz[i] = grounded ? vz[i] * -mu_static : 0.f;
+    }
+}
+
+void cloth::update(float dt)
+{
+    for (float& f : forces_.y)
+    {
+        f += 9.81f * cloth_vertex_mass;
+    }
+
+    const bool implicit = integrator_ == sim::cloth_integrator::implicit_euler;
+    const bool xpbd = integrator_ == sim::cloth_integrator::xpbd;
+    if (implicit)
+    {
+        if (spring_slots_.size() != spring_dampers_.size())
+        {
+            build_implicit_pattern();
+        }
+        assemble_implicit(dt);
+    }
+
+    // explicit spring forces go the same way as the drag below, every spring first and then every vertex gathers them
+    const bool explicit_springs = !implicit && !xpbd;
+    const std::int64_t num_springs = explicit_springs ? spring_dampers_.size() : 0;
+#pragma omp parallel for
+    for (std::int64_t s = 0; s < num_springs; s++)
+    {
+        const std::size_t i0 = spring_dampers_[s].i0, i1 = spring_dampers_[s].i1;
+        const Eigen::Vector3f diff = verts_.get(i1) - verts_.get(i0);
         const float l = diff.norm();
         const Eigen::Vector3f e = diff / l;
-        const float v_close = (velocities_[i0] - velocities_[i1]).dot(e);
-        const float f = -(spring_dampers_[i].dist - l) * k_spring_ - v_close * k_damping_;
-        const Eigen::Vector3f f_0 = e * f;
-        forces_[i0] += f_0;
-        forces_[i1] += -f_0;
+        const float v_close = (velocities_.get(i0) - velocities_.get(i1)).dot(e);
+        const float f = -(spring_dampers_[s].dist - l) * k_spring_ - v_close * k_damping_;
+        spring_forces_[s] = Eigen::Vector4f(e.x(), e.y(), e.z(), f);
     }
 
-    for (std::size_t i = 0; i < inds_.size(); i += 3)
+    // drag of every triangle first, against the normals of the end of the last step, then every vertex gathers the
+    // ones around it. no vertex is written by two threads, so neither pass needs atomics
+    const std::int64_t num_tris = inds_.size();
+#pragma omp parallel for
+    for (std::int64_t t = 0; t < num_tris; t++)
     {
-        const std::size_t i0 = inds_[i][0], i1 = inds_[i][1], i2 = inds_[i][2];
-        const Eigen::Vector3f r0 = verts_[i0], r1 = verts_[i1], r2 = verts_[i2];
-        const Eigen::Vector3f v0 = velocities_[i0], v1 = velocities_[i1], v2 = velocities_[i2];
+        const std::size_t i0 = inds_[t][0], i1 = inds_[t][1], i2 = inds_[t][2];
+        const Eigen::Vector3f v0 = velocities_.get(i0), v1 = velocities_.get(i1), v2 = velocities_.get(i2);
         
         static constexpr float one_third = 1.f / 3.f;
         static constexpr float rho = 1.225f; // fluid density of air
@@ -127,68 +639,249 @@ void cloth::update(float dt)
         const Eigen::Vector3f v_surface = (v0 + v1 + v2) * one_third;
         const Eigen::Vector3f v = v_surface - v_wind_;
         const float v_mag = v.norm();
-        const Eigen::Vector3f v_norm = v / v_mag;
 
-        const Eigen::Vector3f n = Eigen::Vector3f(tri_norms_[i].x(), tri_norms_[i].y(), tri_norms_[i].z());
-        const float l = tri_norms_[i].w();
+        // v_mag^2 times the area facing v, a0 * (v / v_mag).n, without dividing by v_mag. no wind relative to the
+        // triangle is then no force instead of nan
+        const Eigen::Vector3f n = Eigen::Vector3f(tri_norms_[t].x(), tri_norms_[t].y(), tri_norms_[t].z());
+        const float l = tri_norms_[t].w();
         const float a0 = l * .5f;
-        const float a = a0 * v_norm.dot(n);
-        const Eigen::Vector3f f_aero = n * -.5f * rho * v_mag * v_mag * c_drag * a;
-        forces_[i0] += f_aero;
-        forces_[i1] += f_aero;
-        forces_[i2] += f_aero;
+        tri_forces_[t] = n * -.5f * rho * v_mag * v.dot(n) * c_drag * a0;
     }
 
-    for (std::size_t i = 0; i < forces_.size(); i++)
+    // springs then triangles, both ascending, so every vertex adds up its forces in the order of the old serial loops
+    const std::int64_t num_verts = verts_.size();
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < num_verts; i++)
     {
-        if (std::find(std::begin(fixed_), std::end(fixed_), i) == std::end(fixed_)) [[likely]]
+        Eigen::Vector3f f = forces_.get(i);
+        for (std::uint32_t j = vertex_spring_offsets_[i]; explicit_springs && j < vertex_spring_offsets_[i + 1]; j++)
+        {
+            // the i1 end gets the force negated. the multiply stays next to the add so it gets fused the same way as
+            // in the old scatter, which keeps the sums bit for bit
+            const std::uint32_t end = vertex_springs_[j];
+            const Eigen::Vector4f& sf = spring_forces_[end >> 1];
+            f += sf.head<3>() * ((end & 1) ? -sf.w() : sf.w());
+        }
+        for (std::uint32_t j = vertex_triangle_offsets_[i]; j < vertex_triangle_offsets_[i + 1]; j++)
         {
-            velocities_[i] += forces_[i] * dt * inv_mass;
-            verts_[i] += velocities_[i] * dt;
+            f += tri_forces_[vertex_triangles_[j]];
         }
+        forces_.set(i, f);
+    }
 
-        if (verts_[i].y() > 20.1f) // ground plane collision
+    // aero and collision forces go in explicitly, only the springs are linearized. rhs_ has df/dx v * dt so far
+    if (implicit)
+    {
+        const std::int64_t n = forces_.size();
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
         {
-            static constexpr float ep = .05f;
-            static constexpr float mu_static = .75f;
-            const float v_norm_mag = velocities_[i].y(); // v dot up
-            const Eigen::Vector3f v_tan = -velocities_[i] + Eigen::Vector3f(0.f, v_norm_mag, 0.f);
-            const float jy = -(1.f + ep) * v_norm_mag * mass;
-            const Eigen::Vector3f f_static = v_tan * mu_static;
-            const Eigen::Vector3f f_collision = Eigen::Vector3f(0.f, jy / dt - 9.81f, 0.f) + f_static;
-            forces_[i] = f_collision;
+            rhs_[i] = (forces_.get(i) + rhs_[i]) * dt;
         }
-        else
+        solve_implicit();
+
+        // fixed verts got no velocity change
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
         {
-            forces_[i] = Eigen::Vector3f(0.f, 0.f, 0.f);
+            velocities_.add(i, dv_[i]);
         }
     }
-
-    for (std::size_t i = 0; i < norms_.size(); i++)
+    else if (xpbd)
     {
-        norms_[i] = mth::vec3f_zeros();
+        solve_xpbd(dt);
     }
 
-    for (std::size_t i = 0; i < inds_.size(); i++)
+    // xpbd has moved the verts already
+    integrate_vertices(dt, !implicit && !xpbd, !xpbd);
+
+#pragma omp parallel for
+    for (std::int64_t t = 0; t < num_tris; t++)
     {
-        const std::size_t i0 = inds_[i][0], i1 = inds_[i][1], i2 = inds_[i][2];
-        const Eigen::Vector3f r0 = verts_[i0], r1 = verts_[i1], r2 = verts_[i2];
+        const std::size_t i0 = inds_[t][0], i1 = inds_[t][1], i2 = inds_[t][2];
+        const Eigen::Vector3f r0 = verts_.get(i0), r1 = verts_.get(i1), r2 = verts_.get(i2);
         const Eigen::Vector3f cross = (r1 - r0).cross(r2 - r0);
         const float l = cross.norm();
         const Eigen::Vector3f n = cross / l;
-        tri_norms_[i] = Eigen::Vector4f(n.x(), n.y(), n.z(), l);
-        norms_[i0] += n;
-        norms_[i1] += n;
-        norms_[i2] += n;
+        tri_norms_[t] = Eigen::Vector4f(n.x(), n.y(), n.z(), l);
+    }
+
+#pragma omp parallel for
+    for (std::int64_t i = 0; i < num_verts; i++)
+    {
+        Eigen::Vector3f n = mth::vec3f_zeros();
+        for (std::uint32_t j = vertex_triangle_offsets_[i]; j < vertex_triangle_offsets_[i + 1]; j++)
+        {
+            n += tri_norms_[vertex_triangles_[j]].head<3>();
+        }
+        norms_[i] = n;
+    }
+}
+
+namespace
+{
+    // the params are memcpy'd in and out, so they hold plain arrays instead of eigen types
+    using checkpoint_vec3 = std::array<float, 3>;
+
+    inline checkpoint_vec3 to_array(const Eigen::Vector3f& v)
+    {
+        return { v.x(), v.y(), v.z() };
+    }
+
+    inline Eigen::Vector3f to_vector3f(const checkpoint_vec3& v)
+    {
+        return { v[0], v[1], v[2] };
+    }
+
+    // the parameter sections, one struct each so the element size check covers them. add fields at the end and
+    // bump checkpoint::version
+    struct cloth_checkpoint_params
+    {
+        checkpoint_vec3 v_wind;
+        float k_spring;
+        float k_damping;
+        sim::cloth_integrator integrator;
+        sim::implicit_params implicit;
+        sim::xpbd_params xpbd;
+    };
+
+    struct sph_checkpoint_params
+    {
+        float inv_h, inv_h_d, inv_h_d1, h2;
+        float inv_p0, k, mass, skin;
+        float pcisph_delta;
+        float max_pressure_force;
+        sim::grid_backend backend;
+        sim::pressure_solver pressure_solver;
+        sim::pair_evaluation pair_evaluation;
+        sim::reorder_policy reorder;
+        sim::pcisph_params pcisph;
+        std::array<checkpoint_vec3, 2> block;
+        bool sleeping;
+        sim::sleep_params sleep;
+        float viscosity;
+        std::uint64_t initial_size;
+    };
+
+    constexpr std::uint32_t params_tag = checkpoint::tag("parm");
+    constexpr std::uint32_t rng_tag = checkpoint::tag("rng ");
+    constexpr std::uint32_t verts_tag = checkpoint::tag("vert");
+    constexpr std::uint32_t velocities_tag = checkpoint::tag("velo");
+    constexpr std::uint32_t forces_tag = checkpoint::tag("forc");
+    constexpr std::uint32_t norms_tag = checkpoint::tag("norm");
+    constexpr std::uint32_t tri_norms_tag = checkpoint::tag("tnrm");
+    constexpr std::uint32_t inds_tag = checkpoint::tag("inds");
+    constexpr std::uint32_t fixed_tag = checkpoint::tag("fixd");
+    constexpr std::uint32_t springs_tag = checkpoint::tag("sprg");
+    constexpr std::uint32_t velocity_changes_tag = checkpoint::tag("dvel");
+    constexpr std::uint32_t bending_tag = checkpoint::tag("bend");
+    constexpr std::uint32_t particles_tag = checkpoint::tag("part");
+    constexpr std::uint32_t boundary_samples_tag = checkpoint::tag("bsmp");
+    constexpr std::uint32_t containers_tag = checkpoint::tag("cont");
+    constexpr std::uint32_t rest_steps_tag = checkpoint::tag("rest");
+    constexpr std::uint32_t emitters_tag = checkpoint::tag("emit");
+    constexpr std::uint32_t sinks_tag = checkpoint::tag("sink");
+
+    template<typename T>
+    std::vector<T> to_vector(const std::span<const T> data)
+    {
+        return std::vector<T>(std::begin(data), std::end(data));
+    }
+}
+
+void cloth::save_checkpoint(const std::string& filename) const
+{
+    checkpoint::writer file(checkpoint::kind::cloth);
+    file.add_value(params_tag, cloth_checkpoint_params{ .v_wind = to_array(v_wind_), .k_spring = k_spring_, .k_damping = k_damping_,
+        .integrator = integrator_, .implicit = implicit_params_, .xpbd = xpbd_params_ });
+    // the file keeps whole vectors, so the channels get interleaved into copies that live until write()
+    const std::vector<Eigen::Vector3f> verts = verts_.to_vectors();
+    const std::vector<Eigen::Vector3f> velocities = velocities_.to_vectors();
+    const std::vector<Eigen::Vector3f> forces = forces_.to_vectors();
+    file.add(verts_tag, std::span(verts));
+    file.add(velocities_tag, std::span(velocities));
+    file.add(forces_tag, std::span(forces));
+    file.add(norms_tag, std::span(norms_));
+    file.add(tri_norms_tag, std::span(tri_norms_));
+    file.add(inds_tag, std::span(inds_));
+    file.add(fixed_tag, std::span(fixed_));
+    file.add(springs_tag, std::span(spring_dampers_));
+    file.add(velocity_changes_tag, std::span(dv_));
+    file.add(bending_tag, std::span(bending_));
+    file.write(filename);
+}
+
+std::unique_ptr<cloth> cloth::load_checkpoint(const std::string& filename)
+{
+    const checkpoint::reader file(filename, checkpoint::kind::cloth);
+    const cloth_checkpoint_params params = file.value<cloth_checkpoint_params>(params_tag);
+
+    std::unique_ptr<cloth> c(new cloth());
+    c->verts_.assign(file.get<Eigen::Vector3f>(verts_tag));
+    c->velocities_.assign(file.get<Eigen::Vector3f>(velocities_tag));
+    c->forces_.assign(file.get<Eigen::Vector3f>(forces_tag));
+    c->norms_ = to_vector(file.get<Eigen::Vector3f>(norms_tag));
+    c->tri_norms_ = to_vector(file.get<Eigen::Vector4f>(tri_norms_tag));
+    c->inds_ = to_vector(file.get<sim::size3_t>(inds_tag));
+    c->fixed_ = to_vector(file.get<std::size_t>(fixed_tag));
+    c->spring_dampers_ = to_vector(file.get<spring_damper>(springs_tag));
+    c->dv_ = to_vector(file.get<Eigen::Vector3f>(velocity_changes_tag));
+    c->bending_ = to_vector(file.get<spring_damper>(bending_tag));
+    c->v_wind_ = to_vector3f(params.v_wind);
+    c->k_spring_ = params.k_spring;
+    c->k_damping_ = params.k_damping;
+    c->integrator_ = params.integrator;
+    c->implicit_params_ = params.implicit;
+    c->xpbd_params_ = params.xpbd;
+
+    const std::size_t n = c->verts_.size();
+    if (c->velocities_.size() != n || c->forces_.size() != n || c->norms_.size() != n || (!c->dv_.empty() && c->dv_.size() != n))
+    {
+        throw std::runtime_error("checkpoint sections don't match up");
+    }
+    for (const std::vector<spring_damper>* constraints : { &c->spring_dampers_, &c->bending_ })
+    {
+        for (const spring_damper& sd : *constraints)
+        {
+            if (sd.i0 >= n || sd.i1 >= n)
+            {
+                throw std::runtime_error("checkpoint springs are out of range");
+            }
+        }
+    }
+    for (const std::size_t i : c->fixed_)
+    {
+        if (i >= n)
+        {
+            throw std::runtime_error("checkpoint fixed verts are out of range");
+        }
+    }
+    if (c->tri_norms_.size() < c->inds_.size())
+    {
+        throw std::runtime_error("checkpoint sections don't match up");
+    }
+    for (const sim::size3_t& tri : c->inds_)
+    {
+        if (tri[0] >= n || tri[1] >= n || tri[2] >= n)
+        {
+            throw std::runtime_error("checkpoint triangles are out of range");
+        }
     }
+    c->build_vertex_triangles();
+    c->build_vertex_springs();
+    c->update_inv_masses();
+    c->color_constraints(c->spring_dampers_, c->spring_order_, c->spring_colors_);
+    c->color_constraints(c->bending_, c->bending_order_, c->bending_colors_);
+    return c;
 }
 
+#if !defined(XS_HEADLESS)
 draw_item cloth::draw_item(rhi::device* device, rhi::buffer* d_mvp_buf)
 {
     const render_pass& simple_pass = render_pass_registry::get().pass("simple");
 
     d_inds_buf_ = device->create_buffer_unique(rhi::buffer_type::index, inds_.size() * sizeof(sim::size3_t), inds_.data());
-    d_vert_pos_buf_ = device->create_buffer_unique(rhi::buffer_type::vertex, verts_.size() * sizeof(Eigen::Vector3f), verts_.data());
+    d_vert_pos_buf_ = device->create_buffer_unique(rhi::buffer_type::vertex, verts_.size() * sizeof(Eigen::Vector3f), verts_.to_vectors().data());
     d_vert_norm_buf_ = device->create_buffer_unique(rhi::buffer_type::vertex, norms_.size() * sizeof(Eigen::Vector3f), norms_.data());
    
     d_vert_pos_view_ = std::move(device->map_buffer<Eigen::Vector3f>(d_vert_pos_buf_.get(), 0, verts_.size()));
@@ -204,7 +897,11 @@ draw_item cloth::draw_item(rhi::device* device, rhi::buffer* d_mvp_buf)
         .index_buffer(d_inds_buf_.get())
         .uniform_sets({ {0, d_mvp_uniforms_.get()} })
         .update([this](rhi::device*) { 
-                std::copy(std::begin(verts_), std::end(verts_), std::begin(d_vert_pos_view_));
+                Eigen::Vector3f* d_verts = d_vert_pos_view_.data();
+                for (std::size_t i = 0; i < verts_.size(); i++)
+                {
+                    d_verts[i] = verts_.get(i);
+                }
                 std::copy(std::begin(norms_), std::end(norms_), std::begin(d_vert_norm_view_)); 
         })
         .produce_draw();
@@ -308,256 +1005,2316 @@ std::vector<draw_item> mpm_sim::draw_items(rhi::device* device)
 
     return { std::move(rasterize_particles_item) };
 }
+#endif
 
 namespace sim
 {
-    spatial_hash_table::spatial_hash_table(const std::vector<particle>& elements, float cell_size) :
+    spatial_hash_table::spatial_hash_table(const std::vector<particle>& elements, float cell_size, const grid_backend backend, const reorder_policy& reorder) :
         inv_cell_size_(mth::vec3f_replicate(1.f/cell_size)),
-        sorted_elements_(elements),
-        grid_table_(elements.size())
+        backend_(backend),
+        reorder_(reorder),
+        updates_since_reorder_(0),
+        sorted_elements_(),
+        mortons_(elements.size()),
+        order_(elements.size()),
+        grid_table_(),
+        dense_level_(0),
+        dense_min_({ 0, 0, 0 }),
+        dense_dims_({ 0, 0, 0 }),
+        num_blocks_(0)
     {
-        for (particle& p : sorted_elements_)
+        sorted_elements_.gather(elements);
+        for (std::size_t i = 0; i < elements.size(); i++)
         {
-            const size3_t ipos = to_uint_space(p.pos);
-            p.morton = morton_encode(ipos[0], ipos[1], ipos[2]);
+            const size3_t ipos = to_uint_space(elements[i].pos);
+            mortons_[i] = morton_encode(ipos[0], ipos[1], ipos[2]);
         }
 
-        std::sort(std::begin(sorted_elements_), std::end(sorted_elements_), [](const particle& a, const particle& b) { return a.morton < b.morton; });
-        grid_table_.reserve(sorted_elements_.size());
-        for (size_t i = sorted_elements_.size(); i-- > 0;) // can't set i to a potentially negative number in init, so...
+        std::iota(std::begin(order_), std::end(order_), 0);
+        sort_order();
+        gather_elements();
+        if (backend_ == grid_backend::dense)
+        {
+            build_dense_grid();
+        }
+        else
         {
-            const uint64_t hash = hash_coord(sorted_elements_[i].pos);
-            grid_table_[hash] = i;
+            grid_table_.reserve(sorted_elements_.size());
+            build_hash_table();
         }
     }
 
-    void spatial_hash_table::update()
+    bool spatial_hash_table::update(const std::span<const std::uint8_t> removed, const std::span<const particle> added)
     {
-        grid_table_.clear();
-
-#pragma omp parallel for
-        for (std::int64_t i = 0; i < sorted_elements_.size(); i++)
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < std::int64_t(size()); i++)
         {
-            particle& p = sorted_elements_[i];
-            const size3_t ipos = to_uint_space(p.pos);
-            p.morton = morton_encode(ipos[0], ipos[1], ipos[2]);
+            const size3_t ipos = to_uint_space(sorted_elements_.position(i));
+            mortons_[i] = morton_encode(ipos[0], ipos[1], ipos[2]);
         }
 
-        std::sort(std::execution::par, std::begin(sorted_elements_), std::end(sorted_elements_), [](const particle& a, const particle& b) { return a.morton < b.morton; });
+        sort_order();
 
-        for (std::int64_t i = 0; i < sorted_elements_.size(); i++)
+        // the scatter check is a full pass over order_, skip it when it can't trigger
+        updates_since_reorder_++;
+        const bool splice = !removed.empty() || !added.empty();
+        const bool reorder = splice || updates_since_reorder_ >= reorder_.period || (reorder_.max_scatter < 1.f && order_scatter() > reorder_.max_scatter);
+        if (splice)
         {
-            const std::size_t reverse_i = sorted_elements_.size() - i - 1;
-            const uint64_t hash = hash_coord(sorted_elements_[reverse_i].pos);
-            grid_table_[hash] = reverse_i;
+            splice_elements(removed, added);
+        }
+        else if (reorder)
+        {
+            gather_elements();
         }
-    }
-
-    std::vector<particle> spatial_hash_table::get_neighbors(const particle& elem) const
-    {
-        // TODO: is this actually faster?
-        const static size3_t idx_offsets[] = {
-            {-1, -1, -1}, {0, -1, -1}, {1, -1, -1},
-            {-1,  0, -1}, {0,  0, -1}, {1,  0, -1},
-            {-1,  1, -1}, {0,  1, -1}, {1,  1, -1},
-            {-1, -1,  0}, {0, -1,  0}, {1, -1,  0},
-            {-1,  0,  0}, {0,  0,  0}, {1,  0,  0},
-            {-1,  1,  0}, {0,  1,  0}, {1,  1,  0},
-            {-1, -1,  1}, {0, -1,  1}, {1, -1,  1},
-            {-1,  0,  1}, {0,  0,  1}, {1,  0,  1},
-            {-1,  1,  1}, {0,  1,  1}, {1,  1,  1}
-        };
 
+        if (backend_ == grid_backend::dense)
+        {
+            build_dense_grid();
+        }
+        else
+        {
+            build_hash_table();
+        }
+
+        return reorder;
+    }
+
+    void spatial_hash_table::sort_order()
+    {
+        const std::int64_t n = order_.size();
+        if (n < 2)
+        {
+            return;
+        }
+
+        const std::size_t descents = with_policy(parallel_, [&](const auto& policy) {
+            return std::transform_reduce(policy,
+                std::begin(order_), std::prev(std::end(order_)), std::next(std::begin(order_)), std::size_t(0), std::plus<>(),
+                [this](const std::uint32_t a, const std::uint32_t b) { return mortons_[a] > mortons_[b] ? std::size_t(1) : std::size_t(0); }
+            );
+        });
+
+        if (descents == 0)
+        {
+            return;
+        }
+
+        sort_keys_.resize(n);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            sort_keys_[i] = morton_index{ mortons_[order_[i]], order_[i] };
+        }
+
+        // the order barely changes between steps, so when only a few elements are out of place it's cheaper
+        // to pull those out and merge them back in than to do the full radix sort
+        static constexpr std::size_t max_fixup_fraction = 8;
+        if (descents > n / max_fixup_fraction || !fixup_sort_keys())
+        {
+            radix_sort_keys();
+        }
+
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            order_[i] = sort_keys_[i].index;
+        }
+    }
+
+    float spatial_hash_table::order_scatter() const
+    {
+        // a cache line of a channel holds 16 elements, so anything further than this is a miss in every channel
+        constexpr std::uint32_t near_distance = 16;
+        const std::size_t n = order_.size();
+        if (n < 2)
+        {
+            return 0.f;
+        }
+
+        const std::size_t far = with_policy(parallel_, [&](const auto& policy) {
+            return std::transform_reduce(policy,
+                std::begin(order_), std::prev(std::end(order_)), std::next(std::begin(order_)), std::size_t(0), std::plus<>(),
+                [](const std::uint32_t a, const std::uint32_t b) { return (a > b ? a - b : b - a) > near_distance ? std::size_t(1) : std::size_t(0); }
+            );
+        });
+        return float(far) / float(n - 1);
+    }
+
+    void spatial_hash_table::gather_elements()
+    {
+        const std::int64_t n = size();
+        element_scratch_.resize(n);
+        morton_scratch_.resize(n);
+        gather_order_.resize(n);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            element_scratch_.copy(i, sorted_elements_, order_[i]);
+            morton_scratch_[i] = mortons_[order_[i]];
+            gather_order_[i] = order_[i];
+            order_[i] = std::uint32_t(i);
+        }
+        std::swap(sorted_elements_, element_scratch_);
+        std::swap(mortons_, morton_scratch_);
+        updates_since_reorder_ = 0;
+    }
+
+    void spatial_hash_table::splice_elements(const std::span<const std::uint8_t> removed, const std::span<const particle> added)
+    {
+        // stable compaction of order_, every chunk counts its survivors, a scan over the counts gives each chunk where
+        // its survivors go and the chunks write them out side by side, still in morton order
+        static constexpr std::size_t min_chunk_size = 4096;
+        const std::size_t n = order_.size();
+        const std::int64_t num_chunks = (std::max)(std::size_t(1),
+            (std::min)(std::size_t((std::max)(1u, std::thread::hardware_concurrency()) * 4), (n + min_chunk_size - 1) / min_chunk_size));
+        const std::size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+        const auto kept = [&](const std::uint32_t idx) { return removed.empty() || !removed[idx]; };
+
+        chunk_offsets_.assign(num_chunks + 1, 0);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t chunk = 0; chunk < num_chunks; chunk++)
+        {
+            const std::size_t end = (std::min)(n, (chunk + 1) * chunk_size);
+            chunk_offsets_[chunk + 1] = std::size_t(std::count_if(std::begin(order_) + (std::min)(n, chunk * chunk_size), std::begin(order_) + end, kept));
+        }
+        std::inclusive_scan(std::begin(chunk_offsets_), std::end(chunk_offsets_), std::begin(chunk_offsets_));
+
+        sort_scratch_.resize(chunk_offsets_[num_chunks]);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t chunk = 0; chunk < num_chunks; chunk++)
+        {
+            std::size_t out = chunk_offsets_[chunk];
+            const std::size_t end = (std::min)(n, (chunk + 1) * chunk_size);
+            for (std::size_t i = chunk * chunk_size; i < end; i++)
+            {
+                const std::uint32_t idx = order_[i];
+                if (kept(idx))
+                {
+                    sort_scratch_[out++] = morton_index{ mortons_[idx], idx };
+                }
+            }
+        }
+
+        // the new elements are few, they get sorted on their own and merged in. survivors go first on equal codes
+        sort_added_.resize(added.size());
+        for (std::size_t j = 0; j < added.size(); j++)
+        {
+            const size3_t ipos = to_uint_space(added[j].pos);
+            sort_added_[j] = morton_index{ morton_encode(ipos[0], ipos[1], ipos[2]), std::uint32_t(n + j) };
+        }
+        const auto less = [](const morton_index& a, const morton_index& b) { return a.morton < b.morton; };
+        std::stable_sort(std::begin(sort_added_), std::end(sort_added_), less);
+        sort_keys_.resize(sort_scratch_.size() + sort_added_.size());
+        with_policy(parallel_, [&](const auto& policy) {
+            std::merge(policy, std::begin(sort_scratch_), std::end(sort_scratch_), std::begin(sort_added_), std::end(sort_added_),
+                std::begin(sort_keys_), less);
+        });
+
+        const std::int64_t num_elements = sort_keys_.size();
+        element_scratch_.resize(num_elements);
+        morton_scratch_.resize(num_elements);
+        gather_order_.resize(num_elements);
+        order_.resize(num_elements);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < num_elements; i++)
+        {
+            const morton_index key = sort_keys_[i];
+            if (key.index < n)
+            {
+                element_scratch_.copy(i, sorted_elements_, key.index);
+                gather_order_[i] = key.index;
+            }
+            else
+            {
+                element_scratch_.set(i, added[key.index - n]);
+                gather_order_[i] = new_element;
+            }
+            morton_scratch_[i] = key.morton;
+            order_[i] = std::uint32_t(i);
+        }
+        std::swap(sorted_elements_, element_scratch_);
+        std::swap(mortons_, morton_scratch_);
+        updates_since_reorder_ = 0;
+    }
+
+    bool spatial_hash_table::fixup_sort_keys()
+    {
+        const std::int64_t n = sort_keys_.size();
+        static constexpr std::size_t max_displaced_fraction = 4;
+
+        // an element is displaced if anything shortly after it is smaller (it jumped forward) or if it's smaller than
+        // the largest element kept before it (it jumped back), so the kept ones are sorted by construction. that largest
+        // kept element is a max scan over everything that didn't jump forward, the ones that jumped back are below it anyway
+        static constexpr std::int64_t lookahead = 8;
+        const auto jumped_forward = [&](const std::int64_t i) {
+            const uint64_t morton = sort_keys_[i].morton;
+            for (std::int64_t j = i + 1; j < (std::min)(n, i + 1 + lookahead); j++)
+            {
+                if (sort_keys_[j].morton < morton)
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        sort_max_.resize(n);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            sort_max_[i] = jumped_forward(i) ? 0 : sort_keys_[i].morton;
+        }
+        with_policy(parallel_, [&](const auto& policy) {
+            std::inclusive_scan(policy, std::begin(sort_max_), std::end(sort_max_), std::begin(sort_max_),
+                [](const uint64_t a, const uint64_t b) { return (std::max)(a, b); });
+        });
+        const auto displaced = [&](const std::int64_t i) { return (i > 0 && sort_keys_[i].morton < sort_max_[i - 1]) || jumped_forward(i); };
+
+        // stable partition into kept and moved, chunks count their moved keys and then write both runs out side by side
+        static constexpr std::size_t min_chunk_size = 4096;
+        const std::int64_t num_chunks = (std::max)(std::size_t(1),
+            (std::min)(std::size_t((std::max)(1u, std::thread::hardware_concurrency()) * 4), (std::size_t(n) + min_chunk_size - 1) / min_chunk_size));
+        const std::int64_t chunk_size = (n + num_chunks - 1) / num_chunks;
+        chunk_offsets_.assign(num_chunks + 1, 0);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t chunk = 0; chunk < num_chunks; chunk++)
+        {
+            std::size_t count = 0;
+            for (std::int64_t i = chunk * chunk_size; i < (std::min)(n, (chunk + 1) * chunk_size); i++)
+            {
+                count += displaced(i) ? 1 : 0;
+            }
+            chunk_offsets_[chunk + 1] = count;
+        }
+        std::inclusive_scan(std::begin(chunk_offsets_), std::end(chunk_offsets_), std::begin(chunk_offsets_));
+
+        const std::size_t num_moved = chunk_offsets_[num_chunks];
+        if (num_moved > std::size_t(n) / max_displaced_fraction)
+        {
+            return false;
+        }
+
+        sort_moved_.resize(num_moved);
+        sort_kept_.resize(n - num_moved);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t chunk = 0; chunk < num_chunks; chunk++)
+        {
+            std::size_t moved_out = chunk_offsets_[chunk];
+            std::size_t kept_out = std::size_t((std::min)(n, chunk * chunk_size)) - moved_out;
+            for (std::int64_t i = chunk * chunk_size; i < (std::min)(n, (chunk + 1) * chunk_size); i++)
+            {
+                const positioned_key key = { sort_keys_[i], std::uint32_t(i) };
+                if (displaced(i))
+                {
+                    sort_moved_[moved_out++] = key;
+                }
+                else
+                {
+                    sort_kept_[kept_out++] = key;
+                }
+            }
+        }
+
+        // equal keys go by where they were and both runs are in that order already, so this comes out the same as the
+        // stable radix sort whichever path runs
+        const auto less = [](const positioned_key& a, const positioned_key& b) { return a.morton < b.morton || (a.morton == b.morton && a.position < b.position); };
+        with_policy(parallel_, [&](const auto& policy) {
+            std::sort(policy, std::begin(sort_moved_), std::end(sort_moved_), less);
+            std::merge(policy, std::begin(sort_kept_), std::end(sort_kept_), std::begin(sort_moved_), std::end(sort_moved_), std::begin(sort_keys_), less);
+        });
+        return true;
+    }
+
+    void spatial_hash_table::radix_sort_keys()
+    {
+        const std::size_t n = sort_keys_.size();
+        const std::int64_t num_chunks = (std::min)(std::size_t((std::max)(1u, std::thread::hardware_concurrency()) * 4), (n + radix - 1) / radix);
+        const std::size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+        sort_scratch_.resize(n);
+
+        // only sort on digits that actually differ between keys
+        const uint64_t first = sort_keys_[0].morton;
+        const uint64_t varying_bits = with_policy(parallel_, [&](const auto& policy) {
+            return std::transform_reduce(policy, std::begin(sort_keys_), std::end(sort_keys_), uint64_t(0), std::bit_or<>(),
+                [first](const morton_index& k) { return k.morton ^ first; });
+        });
+
+        radix_offsets_.resize(num_chunks);
+        for (std::size_t shift = 0; shift < 64; shift += radix_bits)
+        {
+            if (((varying_bits >> shift) & (radix - 1)) == 0)
+            {
+                continue;
+            }
+
+#pragma omp parallel for if(parallel_)
+            for (std::int64_t chunk = 0; chunk < num_chunks; chunk++)
+            {
+                std::array<std::size_t, radix>& counts = radix_offsets_[chunk];
+                counts.fill(0);
+                const morton_index* keys = sort_keys_.data();
+                const std::size_t end = (std::min)(n, (chunk + 1) * chunk_size);
+                for (std::size_t i = chunk * chunk_size; i < end; i++)
+                {
+                    counts[(keys[i].morton >> shift) & (radix - 1)]++;
+                }
+            }
+
+            // digit major, chunk minor exclusive scan keeps the scatter stable
+            std::size_t offset = 0;
+            for (std::size_t digit = 0; digit < radix; digit++)
+            {
+                for (std::int64_t chunk = 0; chunk < num_chunks; chunk++)
+                {
+                    const std::size_t count = radix_offsets_[chunk][digit];
+                    radix_offsets_[chunk][digit] = offset;
+                    offset += count;
+                }
+            }
+
+#pragma omp parallel for if(parallel_)
+            for (std::int64_t chunk = 0; chunk < num_chunks; chunk++)
+            {
+                std::array<std::size_t, radix>& offsets = radix_offsets_[chunk];
+                const morton_index* keys = sort_keys_.data();
+                morton_index* out = sort_scratch_.data();
+                const std::size_t end = (std::min)(n, (chunk + 1) * chunk_size);
+                for (std::size_t i = chunk * chunk_size; i < end; i++)
+                {
+                    out[offsets[(keys[i].morton >> shift) & (radix - 1)]++] = keys[i];
+                }
+            }
+
+            std::swap(sort_keys_, sort_scratch_);
+        }
+    }
+
+    void spatial_hash_table::build_hash_table()
+    {
+        grid_table_.clear();
+
+        const std::int64_t n = order_.size();
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            const std::size_t reverse_i = n - i - 1;
+            grid_table_[mortons_[order_[reverse_i]]] = reverse_i;
+        }
+    }
+
+    void spatial_hash_table::build_dense_grid()
+    {
+        using bounds_t = std::array<size3_t, 2>;
+        constexpr std::uint32_t uint_max = std::numeric_limits<std::uint32_t>::max();
+        const bounds_t empty_bounds = { size3_t{ uint_max, uint_max, uint_max }, size3_t{ 0, 0, 0 } };
+        const bounds_t bounds = with_policy(parallel_, [&](const auto& policy) {
+            return std::transform_reduce(policy, std::begin(order_), std::end(order_), empty_bounds,
+                [](const bounds_t& a, const bounds_t& b) {
+                    return bounds_t{
+                        size3_t{ (std::min)(a[0][0], b[0][0]), (std::min)(a[0][1], b[0][1]), (std::min)(a[0][2], b[0][2]) },
+                        size3_t{ (std::max)(a[1][0], b[1][0]), (std::max)(a[1][1], b[1][1]), (std::max)(a[1][2], b[1][2]) }
+                    };
+                },
+                [this](const std::uint32_t i) { const size3_t c = to_uint_space(sorted_elements_.position(i)); return bounds_t{ c, c }; }
+            );
+        });
+
+        // coarsen the grid until the bounding box fits in the cell budget, a coarse cell is a morton aligned
+        // block of cells so the elements inside it are still contiguous in order_
+        const std::size_t max_cells = (std::max)(size() * 8, std::size_t(4096));
+        dense_level_ = 0;
+        std::size_t num_cells = 0;
+        for (; dense_level_ < 31; dense_level_++)
+        {
+            for (std::size_t axis = 0; axis < 3; axis++)
+            {
+                dense_min_[axis] = bounds[0][axis] >> dense_level_;
+                dense_dims_[axis] = size() == 0 ? 1 : (bounds[1][axis] >> dense_level_) - dense_min_[axis] + 1;
+            }
+
+            num_cells = std::size_t(dense_dims_[0]) * dense_dims_[1] * dense_dims_[2];
+            if (num_cells <= max_cells)
+            {
+                break;
+            }
+        }
+
+        cell_start_.resize(num_cells);
+        cell_end_.resize(num_cells);
+        with_policy(parallel_, [&](const auto& policy) {
+            std::fill(policy, std::begin(cell_start_), std::end(cell_start_), 0);
+            std::fill(policy, std::begin(cell_end_), std::end(cell_end_), 0);
+        });
+
+        const std::int64_t n = size();
+        element_cells_.resize(n);
+
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            element_cells_[i] = std::uint32_t(dense_cell_index(to_dense_space(sorted_elements_.position(order_[i]))));
+        }
+
+        // every cell is one run of sorted elements, so each boundary is only ever written by one thread
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            const std::uint32_t cell = element_cells_[i];
+            if (i == 0 || element_cells_[i - 1] != cell)
+            {
+                cell_start_[cell] = std::uint32_t(i);
+            }
+
+            if (i == n - 1 || element_cells_[i + 1] != cell)
+            {
+                cell_end_[cell] = std::uint32_t(i + 1);
+            }
+        }
+    }
+
+    std::vector<particle> spatial_hash_table::get_neighbors(const particle& elem) const
+    {
         std::vector<particle> neighbors;
         neighbors.reserve(32);
 
-        for (uint8_t idx_offset = 0; idx_offset < 27; idx_offset++)
+        visit_cell_neighborhood(elem.pos, [&](const std::size_t particle_idx) {
+            if ((sorted_elements_.position(particle_idx) - elem.pos).norm() > 1e-6f)
+            {
+                neighbors.push_back(element(particle_idx));
+            }
+        });
+
+        return neighbors;
+    }
+
+    particle spatial_hash_table::element(const std::size_t i) const
+    {
+        return particle{ sorted_elements_.position(i), sorted_elements_.velocity(i), mortons_[i], sorted_elements_.density[i], sorted_elements_.pressure[i] };
+    }
+
+    void spatial_hash_table::copy_elements(std::vector<particle>& out) const
+    {
+        const std::int64_t n = size();
+        out.resize(n);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            out[i] = element(i);
+        }
+    }
+
+    std::size_t spatial_hash_table::nearest(const Eigen::Vector3f& p, const std::span<query_hit> hits, const float max_radius) const
+    {
+        const std::size_t k = (std::min)(hits.size(), size());
+        if (k == 0)
+        {
+            return 0;
+        }
+
+        // hits is a max heap on distance while searching, a cell around p first and twice the radius until k are in.
+        // everything outside the radius is farther than what's inside, so k within it are the k nearest
+        const auto nearer = [](const query_hit& a, const query_hit& b) { return a.distance2 < b.distance2; };
+        float radius = (std::min)(max_radius, 1.f / inv_cell_size_.maxCoeff());
+        while (true)
+        {
+            std::size_t found = 0;
+            for_each_in_radius(p, radius, [&](const std::uint32_t idx, const float distance2) {
+                if (found < k)
+                {
+                    hits[found++] = { idx, distance2 };
+                    std::push_heap(std::begin(hits), std::begin(hits) + found, nearer);
+                }
+                else if (distance2 < hits[0].distance2)
+                {
+                    std::pop_heap(std::begin(hits), std::begin(hits) + k, nearer);
+                    hits[k - 1] = { idx, distance2 };
+                    std::push_heap(std::begin(hits), std::begin(hits) + k, nearer);
+                }
+            });
+
+            if (found == k || radius >= max_radius)
+            {
+                std::sort_heap(std::begin(hits), std::begin(hits) + found, nearer);
+                return found;
+            }
+            radius = (std::min)(max_radius, radius * 2.f);
+        }
+    }
+
+    std::optional<ray_hit> spatial_hash_table::raycast(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, const float max_t, const float radius) const
+    {
+        // elements come in cells of rising t and a sphere can't be entered more than radius before the cell it's
+        // reported from, so once the march is radius past the best hit nothing nearer is left
+        std::optional<ray_hit> best;
+        visit_segment(origin, dir.normalized(), max_t, radius,
+            [&](const std::uint32_t idx, const float t) {
+                if (!best || t < best->t)
+                {
+                    best = ray_hit{ idx, t };
+                }
+                return true;
+            },
+            [&](const float t0) { return !best || t0 - radius <= best->t; });
+        return best;
+    }
+
+    void particle_soa::resize(const std::size_t n)
+    {
+        for (aligned_vector<float>* channel : { &x, &y, &z, &vx, &vy, &vz, &density, &pressure })
+        {
+            channel->resize(n);
+        }
+    }
+
+    void particle_soa::gather(const std::vector<particle>& particles)
+    {
+        const std::int64_t n = particles.size();
+        resize(n);
+
+#pragma omp parallel for
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            set(i, particles[i]);
+        }
+    }
+
+#if defined(__AVX2__)
+    static inline float hsum(const __m256 v)
+    {
+        const __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        const __m128 sum2 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+        const __m128 sum1 = _mm_add_ss(sum2, _mm_shuffle_ps(sum2, sum2, 1));
+        return _mm_cvtss_f32(sum1);
+    }
+
+#endif
+
+    // how the kernels read the neighbors of particle i, relative to i. one at a time or 8 at a time with avx2
+    struct kernel_reader
+    {
+        kernel_reader(const particle_soa& soa, const std::size_t i) :
+            soa(soa),
+            pos(soa.position(i)),
+            vel(soa.velocity(i))
+        {
+        }
+
+        inline void position_offset(const std::uint32_t j, float d[3]) const
+        {
+            d[0] = soa.x[j] - pos.x(); d[1] = soa.y[j] - pos.y(); d[2] = soa.z[j] - pos.z();
+        }
+
+        inline void velocity_offset(const std::uint32_t j, float d[3]) const
+        {
+            d[0] = soa.vx[j] - vel.x(); d[1] = soa.vy[j] - vel.y(); d[2] = soa.vz[j] - vel.z();
+        }
+
+#if defined(__AVX2__)
+        inline void position_offsets(const __m256i v_j, __m256& dx, __m256& dy, __m256& dz) const
+        {
+            dx = _mm256_sub_ps(_mm256_i32gather_ps(soa.x.data(), v_j, 4), _mm256_set1_ps(pos.x()));
+            dy = _mm256_sub_ps(_mm256_i32gather_ps(soa.y.data(), v_j, 4), _mm256_set1_ps(pos.y()));
+            dz = _mm256_sub_ps(_mm256_i32gather_ps(soa.z.data(), v_j, 4), _mm256_set1_ps(pos.z()));
+        }
+
+        inline void velocity_offsets(const __m256i v_j, __m256& dx, __m256& dy, __m256& dz) const
+        {
+            dx = _mm256_sub_ps(_mm256_i32gather_ps(soa.vx.data(), v_j, 4), _mm256_set1_ps(vel.x()));
+            dy = _mm256_sub_ps(_mm256_i32gather_ps(soa.vy.data(), v_j, 4), _mm256_set1_ps(vel.y()));
+            dz = _mm256_sub_ps(_mm256_i32gather_ps(soa.vz.data(), v_j, 4), _mm256_set1_ps(vel.z()));
+        }
+#endif
+
+        const particle_soa& soa;
+        const Eigen::Vector3f pos;
+        const Eigen::Vector3f vel;
+    };
+
+    void spatial_hash_table::build_neighbor_lists(const float radius)
+    {
+        num_blocks_ = 0;
+        build_lists(sorted_elements_, radius, true, neighbor_offsets_, neighbor_indices_);
+    }
+
+    void spatial_hash_table::build_symmetric_neighbor_lists(const float radius, const std::uint32_t num_blocks)
+    {
+        num_blocks_ = (std::max)(1u, num_blocks);
+        element_blocks_.resize(size());
+        neighbor_splits_.resize(size());
+
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t b = 0; b < num_blocks_; b++)
+        {
+            for (const std::uint32_t i : block(b))
+            {
+                element_blocks_[i] = std::uint32_t(b);
+            }
+        }
+
+        build_lists(sorted_elements_, radius, true, neighbor_offsets_, neighbor_indices_, element_blocks_.data(), neighbor_splits_.data());
+    }
+
+    void spatial_hash_table::build_query_lists(const particle_soa& queries, const float radius,
+        std::vector<std::uint32_t>& offsets, std::vector<std::uint32_t>& indices) const
+    {
+        build_lists(queries, radius, false, offsets, indices);
+    }
+
+    void spatial_hash_table::build_lists(const particle_soa& queries, const float radius, const bool self,
+        std::vector<std::uint32_t>& offsets, std::vector<std::uint32_t>& indices, const std::uint32_t* blocks, std::uint32_t* splits) const
+    {
+        // the lower index of a pair in one block lists it, the higher one skips it. an element never lists itself, but
+        // does list another one at the same spot
+        const auto listed = [self, blocks](const std::size_t i, const std::size_t j) { return !(self && i == j) && (!blocks || j > i || blocks[i] != blocks[j]); };
+
+        const float radius2 = radius * radius;
+        const std::int64_t n = queries.size();
+        offsets.resize(n + 1);
+        offsets[0] = 0;
+
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            const Eigen::Vector3f pos = queries.position(i);
+            std::uint32_t count = 0;
+            visit_cell_neighborhood(pos, [&](const std::size_t j) {
+                const float d2 = (sorted_elements_.position(j) - pos).squaredNorm();
+                count += (d2 < radius2 && listed(i, j)) ? 1 : 0;
+            });
+            offsets[i + 1] = count;
+        }
+
+        with_policy(parallel_, [&](const auto& policy) {
+            std::inclusive_scan(policy, std::next(std::begin(offsets)), std::end(offsets), std::next(std::begin(offsets)));
+        });
+        indices.resize(offsets[n]);
+
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            const Eigen::Vector3f pos = queries.position(i);
+            std::uint32_t* out = indices.data() + offsets[i];
+            std::uint32_t* out_back = indices.data() + offsets[i + 1];
+            visit_cell_neighborhood(pos, [&](const std::size_t j) {
+                const float d2 = (sorted_elements_.position(j) - pos).squaredNorm();
+                if (d2 < radius2 && listed(i, j))
+                {
+                    // pairs within the block from the front, pairs across blocks from the back
+                    if (!blocks || blocks[i] == blocks[j])
+                    {
+                        *out++ = std::uint32_t(j);
+                    }
+                    else
+                    {
+                        *--out_back = std::uint32_t(j);
+                    }
+                }
+            });
+
+            if (splits)
+            {
+                splits[i] = std::uint32_t(out - (indices.data() + offsets[i]));
+            }
+        }
+    }
+
+    static inline std::uint64_t pack_run(const std::uint32_t front, const std::uint32_t back)
+    {
+        return (std::uint64_t(front) << 32) | back;
+    }
+
+#if defined(__linux__)
+    // the cpus this process may run on, which taskset, cgroups and the like can narrow down from all of them
+    static std::vector<std::uint32_t> allowed_cpus()
+    {
+        std::vector<std::uint32_t> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (std::uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        return cpus;
+    }
+#endif
+
+    static std::uint32_t default_num_threads()
+    {
+#if defined(__linux__)
+        const std::size_t allowed = allowed_cpus().size();
+        if (allowed > 0)
+        {
+            return std::uint32_t(allowed);
+        }
+#endif
+        return (std::max)(1u, std::thread::hardware_concurrency());
+    }
+
+    tile_scheduler::tile_scheduler(const std::uint32_t threads, const bool pin_threads) :
+        runs_(threads > 0 ? threads : default_num_threads()),
+        workers_(),
+        fn_(nullptr),
+        generation_(0),
+        busy_(0),
+        stop_(false)
+    {
+#if defined(__linux__)
+        const std::vector<std::uint32_t> cpus = pin_threads ? allowed_cpus() : std::vector<std::uint32_t>();
+        bool pinned = !pin_threads || !cpus.empty();
+#endif
+
+        // the calling thread is thread 0, it only ever helps with a run() it made
+        workers_.reserve(runs_.size() - 1);
+        for (std::uint32_t t = 1; t < runs_.size(); t++)
+        {
+            workers_.emplace_back([this, t]() { worker(t); });
+
+#if defined(__linux__)
+            if (pin_threads && pinned)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[t % cpus.size()], &set);
+                pinned = pthread_setaffinity_np(workers_.back().native_handle(), sizeof(set), &set) == 0;
+            }
+#endif
+        }
+
+#if defined(__linux__)
+        if (!pinned)
+        {
+            stop();
+            throw std::runtime_error("tile_scheduler couldn't pin its workers");
+        }
+#endif
+    }
+
+    tile_scheduler::~tile_scheduler()
+    {
+        stop();
+    }
+
+    void tile_scheduler::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        start_cv_.notify_all();
+        for (std::thread& worker : workers_)
+        {
+            worker.join();
+        }
+        workers_.clear();
+    }
+
+    std::shared_ptr<tile_scheduler> tile_scheduler::shared()
+    {
+        static std::mutex mutex;
+        static std::weak_ptr<tile_scheduler> scheduler;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<tile_scheduler> result = scheduler.lock();
+        if (!result)
+        {
+            result = std::make_shared<tile_scheduler>();
+            scheduler = result;
+        }
+        return result;
+    }
+
+    void tile_scheduler::run(const std::span<const float> tile_costs, const std::function<void(std::uint32_t)>& fn)
+    {
+        // sims sharing the scheduler from different threads, the runs and the workers are used by one at a time
+        std::lock_guard<std::mutex> run_lock(run_mutex_);
+        const std::uint32_t num_tiles = std::uint32_t(tile_costs.size());
+        const std::uint32_t num_runs = num_threads();
+
+        // thread t gets the tiles where the cost prefix sum passes t / num_runs of the total, always the same
+        // contiguous stretch of the sim for the same costs
+        const float total = std::reduce(std::begin(tile_costs), std::end(tile_costs), 0.f);
+        std::uint32_t tile = 0;
+        float prefix = 0.f;
+        for (std::uint32_t t = 0; t < num_runs; t++)
+        {
+            const std::uint32_t front = tile;
+            const float end = total * float(t + 1) / float(num_runs);
+            while (tile < num_tiles && (t + 1 == num_runs || prefix + tile_costs[tile] * .5f < end))
+            {
+                prefix += tile_costs[tile];
+                tile++;
+            }
+            runs_[t].range.store(pack_run(front, tile), std::memory_order_relaxed);
+        }
+
+        if (num_runs == 1)
+        {
+            for (std::uint32_t i = 0; i < num_tiles; i++)
+            {
+                fn(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fn_ = &fn;
+            busy_ = num_runs - 1;
+            generation_++;
+        }
+        start_cv_.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]() { return busy_ == 0; });
+        fn_ = nullptr;
+    }
+
+    void tile_scheduler::worker(const std::uint32_t thread)
+    {
+        std::uint64_t generation = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                start_cv_.wait(lock, [&]() { return stop_ || generation_ != generation; });
+                if (stop_)
+                {
+                    return;
+                }
+                generation = generation_;
+            }
+
+            work(thread);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--busy_ == 0)
+            {
+                done_cv_.notify_one();
+            }
+        }
+    }
+
+    void tile_scheduler::work(const std::uint32_t thread)
+    {
+        const std::function<void(std::uint32_t)>& fn = *fn_;
+
+        // own run from the front, so a thread walks its tiles in the same order every time
+        std::atomic<std::uint64_t>& own = runs_[thread].range;
+        std::uint64_t range = own.load(std::memory_order_acquire);
+        while (true)
+        {
+            const std::uint32_t front = std::uint32_t(range >> 32), back = std::uint32_t(range);
+            if (front >= back)
+            {
+                break;
+            }
+            if (own.compare_exchange_weak(range, pack_run(front + 1, back), std::memory_order_acq_rel))
+            {
+                fn(front);
+                range = own.load(std::memory_order_acquire);
+            }
+        }
+
+        // other runs from the back, the next runs over first since they're the closest in morton order
+        const std::uint32_t num_runs = num_threads();
+        for (std::uint32_t offset = 1; offset < num_runs; offset++)
+        {
+            std::atomic<std::uint64_t>& victim = runs_[(thread + offset) % num_runs].range;
+            range = victim.load(std::memory_order_acquire);
+            while (true)
+            {
+                const std::uint32_t front = std::uint32_t(range >> 32), back = std::uint32_t(range);
+                if (front >= back)
+                {
+                    break;
+                }
+                if (victim.compare_exchange_weak(range, pack_run(front, back - 1), std::memory_order_acq_rel))
+                {
+                    fn(back - 1);
+                    range = victim.load(std::memory_order_acquire);
+                }
+            }
+        }
+    }
+}
+
+const sim::range3_t sph_sim::default_container = { mth::vec3f_replicate(-3.f), mth::vec3f_replicate(3.f) };
+
+sph_sim::sph_sim(const sim::range3_t& block, const std::size_t num_particles, const float h, const float p0, const float k, const float skin,
+    const sim::grid_backend backend, const sim::reorder_policy& reorder, const mth::pcg32& rand, const std::optional<sim::range3_t>& container) :
+    grid_(),
+    forces_(num_particles, mth::vec3f_zeros()),
+    list_positions_(),
+    kernel_(),
+    inv_h_(1.f / h),
+    inv_h_d_(sim::pow<3>(1.f / h)),
+    inv_h_d1_(sim::pow<4>(1.f / h)),
+    h2_(h * h),
+    inv_p0_(1.f / p0),
+    k_(k),
+    viscosity_(.001f),
+    mass_(sim::pow<3>(h) * p0),
+    skin_(skin),
+    grid_backend_(backend),
+    reorder_(reorder),
+    pressure_solver_(sim::pressure_solver::state_equation),
+    pcisph_params_(),
+    pair_evaluation_(sim::pair_evaluation::gather),
+    pcisph_delta_(0.f),
+    max_pressure_force_(0.f),
+    emitters_(),
+    emitter_samples_(),
+    sinks_(),
+    flow_changed_(false),
+    scheduler_(sim::tile_scheduler::shared()),
+    parallel_(scheduler_->num_threads() > 1),
+    tile_costs_(),
+    awake_tiles_(),
+    awake_costs_(),
+    sleeping_(false),
+    sleep_params_(),
+    block_(block),
+    initial_size_(num_particles),
+    rand_(rand),
+    timings_(),
+    snapshots_(),
+    snapshot_reader_(false)
+#if !defined(XS_HEADLESS)
+    , max_drawn_(0),
+    drawn_particles_(0)
+#endif
+{
+    mth::pcg32 rng = rand_;
+    const Eigen::Vector3f block_dim = block[1] - block[0];
+    std::vector<sim::particle> particles;
+    particles.reserve(num_particles);
+    for (std::size_t i = 0; i < num_particles; i++)
+    {
+        const Eigen::Vector3f rand3 = Eigen::Vector3f(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
+        const Eigen::Vector3f point = block[0] + block_dim.cwiseProduct(rand3);
+        particles.emplace_back(point, Eigen::Vector3f::Zero(), 0, 0.f, 0.f);
+    }
+
+    grid_ = sim::spatial_hash_table(std::move(particles), h * 2.f + skin_, grid_backend_, reorder_);
+    grid_.set_parallel(parallel_);
+    rebuild_neighbors(true);
+    sample_kernels();
+
+    // pcisph scaling factor from a particle with a full neighborhood on a grid with the resting spacing,
+    // delta = p0^2 / (2 m^2 dt^2 (sum(grad) . sum(grad) + sum(grad . grad)))
+    Eigen::Vector3f grad_sum = mth::vec3f_zeros();
+    float grad_dot_sum = 0.f;
+    for (std::int32_t z = -2; z <= 2; z++)
+    {
+        for (std::int32_t y = -2; y <= 2; y++)
+        {
+            for (std::int32_t x = -2; x <= 2; x++)
+            {
+                const Eigen::Vector3f d = Eigen::Vector3f(float(x), float(y), float(z)) * h;
+                const float r = d.norm();
+                if (r <= 0.f || r >= 2.f * h)
+                {
+                    continue;
+                }
+
+                const Eigen::Vector3f grad = d * (dkernel_[(std::min)(size_t(r * inv_h_ * inv_step), dkernel_.size() - 1)] * inv_h_d1_ / r);
+                grad_sum += grad;
+                grad_dot_sum += grad.squaredNorm();
+            }
+        }
+    }
+    pcisph_delta_ = p0 * p0 / (2.f * mass_ * mass_ * (grad_sum.squaredNorm() + grad_dot_sum));
+
+    if (container)
+    {
+        add_boundary_box(*container);
+    }
+}
+
+sph_sim::sph_sim() :
+    inv_h_(0.f),
+    inv_h_d_(0.f),
+    inv_h_d1_(0.f),
+    h2_(0.f),
+    inv_p0_(0.f),
+    k_(0.f),
+    viscosity_(0.f),
+    mass_(0.f),
+    skin_(0.f),
+    grid_backend_(sim::grid_backend::hash),
+    reorder_(),
+    pressure_solver_(sim::pressure_solver::state_equation),
+    pcisph_params_(),
+    pair_evaluation_(sim::pair_evaluation::gather),
+    pcisph_delta_(0.f),
+    max_pressure_force_(0.f),
+    flow_changed_(false),
+    scheduler_(sim::tile_scheduler::shared()),
+    parallel_(scheduler_->num_threads() > 1),
+    sleeping_(false),
+    sleep_params_(),
+    block_(),
+    initial_size_(0),
+    rand_(),
+    timings_(),
+    snapshots_(),
+    snapshot_reader_(false)
+#if !defined(XS_HEADLESS)
+    , max_drawn_(0),
+    drawn_particles_(0)
+#endif
+{
+    sample_kernels();
+}
+
+void sph_sim::sample_kernels()
+{
+    float itr = 0.f;
+    for (size_t i = 0; i < kernel_.size(); i++, itr += step)
+    {
+        kernel_[i] = sim::cubic_kernel(itr);
+        dkernel_[i] = sim::dcubic_kernel(itr);
+    }
+}
+
+void sph_sim::add_boundary_box(const sim::range3_t& box)
+{
+    // cell centers of a lattice in a shell just outside the box, as thick as the kernel support so a particle on the
+    // wall still gets pushed back in. the cells are about h wide and fit the box exactly
+    static constexpr std::int32_t layers = 3;
+    const float spacing = 1.f / inv_h_;
+    const Eigen::Vector3f extent = box[1] - box[0];
+    const std::array<std::int32_t, 3> segments = { (std::max)(1, std::int32_t(std::round(extent.x() / spacing))),
+        (std::max)(1, std::int32_t(std::round(extent.y() / spacing))), (std::max)(1, std::int32_t(std::round(extent.z() / spacing))) };
+    const Eigen::Vector3f step = extent.cwiseQuotient(Eigen::Vector3f(float(segments[0]), float(segments[1]), float(segments[2])));
+    for (std::int32_t z = -layers; z < segments[2] + layers; z++)
+    {
+        for (std::int32_t y = -layers; y < segments[1] + layers; y++)
+        {
+            for (std::int32_t x = -layers; x < segments[0] + layers; x++)
+            {
+                const bool inside = x >= 0 && y >= 0 && z >= 0 && x < segments[0] && y < segments[1] && z < segments[2];
+                if (!inside)
+                {
+                    const Eigen::Vector3f cell = Eigen::Vector3f(float(x) + .5f, float(y) + .5f, float(z) + .5f);
+                    boundary_samples_.push_back(box[0] + step.cwiseProduct(cell));
+                }
+            }
+        }
+    }
+
+    containers_.push_back(box);
+    build_boundary();
+}
+
+void sph_sim::add_boundary_mesh(const std::vector<Eigen::Vector3f>& verts, const std::vector<sim::size3_t>& inds)
+{
+    // barycentric lattice per triangle, shared edges get sampled twice but the boundary volumes make up for it
+    const float spacing = 1.f / inv_h_;
+    for (const sim::size3_t& tri : inds)
+    {
+        const Eigen::Vector3f& a = verts[tri[0]];
+        const Eigen::Vector3f ab = verts[tri[1]] - a;
+        const Eigen::Vector3f ac = verts[tri[2]] - a;
+        const float max_edge = (std::max)({ ab.norm(), ac.norm(), (ac - ab).norm() });
+        const std::uint32_t segments = (std::max)(1u, std::uint32_t(std::ceil(max_edge / spacing)));
+        for (std::uint32_t u = 0; u <= segments; u++)
+        {
+            for (std::uint32_t v = 0; u + v <= segments; v++)
+            {
+                boundary_samples_.push_back(a + ab * (float(u) / float(segments)) + ac * (float(v) / float(segments)));
+            }
+        }
+    }
+
+    build_boundary();
+}
+
+void sph_sim::clear_boundaries()
+{
+    boundary_samples_.clear();
+    containers_.clear();
+    build_boundary();
+}
+
+void sph_sim::add_emitter(const sim::emitter& emitter)
+{
+    emitters_.push_back(emitter);
+    sample_emitter(emitter);
+    flow_changed_ = true;
+}
+
+void sph_sim::sample_emitter(const sim::emitter& emitter)
+{
+    const float h = 1.f / inv_h_;
+    if (emitter.shape == sim::emitter_shape::box)
+    {
+        const Eigen::Vector3f dims = emitter.box[1] - emitter.box[0];
+        const std::array<std::size_t, 3> counts = {
+            std::size_t(dims.x() * inv_h_) + 1, std::size_t(dims.y() * inv_h_) + 1, std::size_t(dims.z() * inv_h_) + 1
+        };
+        for (std::size_t z = 0; z < counts[2]; z++)
+        {
+            for (std::size_t y = 0; y < counts[1]; y++)
+            {
+                for (std::size_t x = 0; x < counts[0]; x++)
+                {
+                    const Eigen::Vector3f pos = emitter.box[0] + Eigen::Vector3f(float(x), float(y), float(z)) * h;
+                    emitter_samples_.emplace_back(pos, emitter.velocity, 0, 0.f, 0.f);
+                }
+            }
+        }
+    }
+    else
+    {
+        // a square grid over the disc, in the plane normal to the velocity
+        const Eigen::Vector3f normal = emitter.velocity.normalized();
+        const Eigen::Vector3f u = normal.unitOrthogonal();
+        const Eigen::Vector3f v = normal.cross(u);
+        const std::int32_t steps = std::int32_t(emitter.radius * inv_h_);
+        for (std::int32_t y = -steps; y <= steps; y++)
+        {
+            for (std::int32_t x = -steps; x <= steps; x++)
+            {
+                if (x * x + y * y <= steps * steps)
+                {
+                    const Eigen::Vector3f pos = emitter.center + (u * float(x) + v * float(y)) * h;
+                    emitter_samples_.emplace_back(pos, emitter.velocity, 0, 0.f, 0.f);
+                }
+            }
+        }
+    }
+}
+
+void sph_sim::add_sink(const sim::range3_t& box)
+{
+    sinks_.push_back(box);
+    flow_changed_ = true;
+}
+
+void sph_sim::clear_emitters()
+{
+    emitters_.clear();
+    emitter_samples_.clear();
+}
+
+void sph_sim::clear_sinks()
+{
+    sinks_.clear();
+}
+
+bool sph_sim::update_flow(const float max_displacement)
+{
+    const sim::particle_soa& soa = grid_.elements();
+    const std::int64_t n = grid_.size();
+    removed_.resize(n);
+    std::size_t num_removed = 0;
+#pragma omp parallel for if(parallel_) reduction(+ : num_removed)
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        const Eigen::Vector3f pos = soa.position(i);
+        const bool removed = std::any_of(std::begin(sinks_), std::end(sinks_), [&](const sim::range3_t& sink) {
+            return (pos.array() >= sink[0].array()).all() && (pos.array() <= sink[1].array()).all();
+        });
+        removed_[i] = removed ? 1 : 0;
+        num_removed += removed ? 1 : 0;
+    }
+
+    // the cells are still where the particles were at the last update, anything within h of a sample now was within
+    // h + max_displacement of it then
+    const float h = 1.f / inv_h_;
+    const std::int64_t num_samples = emitter_samples_.size();
+    free_samples_.resize(num_samples);
+#pragma omp parallel for if(parallel_)
+    for (std::int64_t s = 0; s < num_samples; s++)
+    {
+        bool free = true;
+        grid_.for_each_in_radius(emitter_samples_[s].pos, h + max_displacement, [&](const std::uint32_t idx, const float) {
+            free = free && (removed_[idx] || (soa.position(idx) - emitter_samples_[s].pos).squaredNorm() >= h2_);
+        });
+        free_samples_[s] = free ? 1 : 0;
+    }
+
+    emitted_.clear();
+    for (std::int64_t s = 0; s < num_samples; s++)
+    {
+        if (free_samples_[s])
+        {
+            emitted_.push_back(emitter_samples_[s]);
+        }
+    }
+
+    return grid_.update(num_removed > 0 ? std::span<const std::uint8_t>(removed_) : std::span<const std::uint8_t>(), emitted_);
+}
+
+void sph_sim::build_boundary()
+{
+    boundary_grid_ = sim::spatial_hash_table();
+    boundary_volumes_.clear();
+    if (!boundary_samples_.empty())
+    {
+        std::vector<sim::particle> particles;
+        particles.reserve(boundary_samples_.size());
+        for (const Eigen::Vector3f& sample : boundary_samples_)
+        {
+            particles.emplace_back(sample, Eigen::Vector3f::Zero(), 0, 0.f, 0.f);
+        }
+
+        // boundary particles never move, so the grid and the volumes only get built here
+        boundary_grid_ = sim::spatial_hash_table(std::move(particles), 2.f / inv_h_ + skin_, sim::grid_backend::dense);
+        boundary_grid_.set_parallel(parallel_);
+        boundary_grid_.build_neighbor_lists(2.f / inv_h_);
+
+        // psi = p0 / sum(W) over the boundary neighborhood, so densely sampled parts don't push harder (Akinci 2012)
+        const sim::particle_soa& boundary = boundary_grid_.elements();
+        const std::int64_t n = boundary_grid_.size();
+        boundary_volumes_.resize(n);
+#pragma omp parallel for if(parallel_)
+        for (std::int64_t b = 0; b < n; b++)
         {
-            const uint32_t hash = hash_coord(elem.pos, idx_offsets[idx_offset]);
-            const auto cell_itr = grid_table_.find(hash);
-            if (cell_itr == std::end(grid_table_))
+            const Eigen::Vector3f pos = boundary.position(b);
+            float sum = kernel_[0];
+            for (const std::uint32_t k : boundary_grid_.neighbors(b))
             {
-                continue;
+                sum += sample_kernel((boundary.position(k) - pos).norm() * inv_h_);
+            }
+            boundary_volumes_[b] = 1.f / (inv_p0_ * inv_h_d_ * sum);
+        }
+    }
+
+    rebuild_neighbors(false);
+}
+
+void sph_sim::set_pair_evaluation(const sim::pair_evaluation mode)
+{
+    pair_evaluation_ = mode;
+    rebuild_neighbors(false);
+}
+
+void sph_sim::set_scheduler(std::shared_ptr<sim::tile_scheduler> scheduler)
+{
+    scheduler_ = std::move(scheduler);
+    parallel_ = scheduler_->num_threads() > 1;
+    grid_.set_parallel(parallel_);
+    boundary_grid_.set_parallel(parallel_);
+    rebuild_neighbors(false);
+}
+
+void sph_sim::rebuild_neighbors(const bool reordered)
+{
+    // a few tiles per thread at least so there's something to steal, the symmetric blocks are the same tiles
+    const std::uint32_t num_tiles = (std::max)(scheduler_->num_threads() * min_tiles_per_thread, std::uint32_t((grid_.size() + tile_size - 1) / tile_size));
+    if (pair_evaluation_ == sim::pair_evaluation::symmetric)
+    {
+        grid_.build_symmetric_neighbor_lists(2.f / inv_h_ + skin_, num_tiles);
+    }
+    else
+    {
+        grid_.build_neighbor_lists(2.f / inv_h_ + skin_);
+    }
+    if (boundary_grid_.size() > 0)
+    {
+        boundary_grid_.build_query_lists(grid_.elements(), 2.f / inv_h_ + skin_, boundary_offsets_, boundary_indices_);
+    }
+    else
+    {
+        boundary_offsets_.assign(grid_.size() + 1, 0);
+        boundary_indices_.clear();
+    }
+
+    const sim::particle_soa& soa = grid_.elements();
+    const std::int64_t n = grid_.size();
+    list_positions_.resize(n);
+#pragma omp parallel for if(parallel_)
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        list_positions_[i] = soa.position(i);
+    }
+
+    forces_.resize(grid_.size(), mth::vec3f_zeros());
+    if (sleeping_)
+    {
+        if (reordered && !rest_steps_.empty())
+        {
+            gather_rest_steps();
+        }
+        if (rest_steps_.size() != grid_.size())
+        {
+            rest_steps_.assign(grid_.size(), 0);
+        }
+        particle_tiles_.resize(grid_.size());
+    }
+
+    // the kernel sums dominate a step, so a tile costs about as much as it has neighbors. the tiles get cut anew,
+    // a new tile sleeps if all of its particles have been at rest long enough
+    tile_costs_.resize(num_tiles);
+    tile_asleep_.assign(num_tiles, 0);
+#pragma omp parallel for if(parallel_)
+    for (std::int64_t tile = 0; tile < num_tiles; tile++)
+    {
+        float cost = 0.f;
+        bool asleep = sleeping_;
+        for (const std::uint32_t i : grid_.morton_range(tile, num_tiles))
+        {
+            cost += float(grid_.neighbors(i).size() + (boundary_offsets_[i + 1] - boundary_offsets_[i])) + 4.f;
+            if (sleeping_)
+            {
+                particle_tiles_[i] = std::uint32_t(tile);
+                asleep = asleep && rest_steps_[i] >= sleep_params_.rest_steps;
             }
+        }
+        tile_costs_[tile] = cost;
+        tile_asleep_[tile] = asleep ? 1 : 0;
+    }
+    collect_awake_tiles();
+}
+
+void sph_sim::gather_rest_steps()
+{
+    const std::span<const std::uint32_t> from = grid_.last_gather();
+    rest_scratch_.resize(from.size());
+    sim::with_policy(parallel_, [&](const auto& policy) {
+        std::transform(policy, std::begin(from), std::end(from), std::begin(rest_scratch_),
+            [this](const std::uint32_t i) { return i == sim::spatial_hash_table::new_element ? 0 : rest_steps_[i]; });
+    });
+    std::swap(rest_steps_, rest_scratch_);
+}
+
+void sph_sim::collect_awake_tiles()
+{
+    awake_tiles_.clear();
+    awake_costs_.clear();
+    for (std::uint32_t tile = 0; tile < tile_costs_.size(); tile++)
+    {
+        if (!tile_asleep_[tile])
+        {
+            awake_tiles_.push_back(tile);
+            awake_costs_.push_back(tile_costs_[tile]);
+        }
+    }
+}
 
-            static constexpr uint64_t max_morton_diff = 1;
+void sph_sim::set_sleeping(const bool enabled, const sim::sleep_params& params)
+{
+    sleeping_ = enabled;
+    sleep_params_ = params;
+    rest_steps_.clear();
+    rebuild_neighbors(false);
+}
 
-            size_t particle_idx = cell_itr->second;
+std::size_t sph_sim::num_sleeping() const
+{
+    std::size_t sleeping = 0;
+    for (std::uint32_t tile = 0; tile < tile_asleep_.size(); tile++)
+    {
+        sleeping += tile_asleep_[tile] ? grid_.morton_range(tile, tile_asleep_.size()).size() : 0;
+    }
+    return sleeping;
+}
 
-            const uint64_t morton = sorted_elements_[particle_idx].morton;
-            do
+void sph_sim::update_sleep()
+{
+    const float max_speed2 = sleep_params_.max_speed * sleep_params_.max_speed;
+    const float max_force = sleep_params_.max_acceleration * mass_;
+    const float max_force2 = max_force * max_force;
+    const bool any_asleep = awake_tiles_.size() < tile_asleep_.size();
+
+    // moving particles wake every sleeping tile in their neighbor lists, which hold anything that could come within
+    // the kernel support before the next rebuild
+    sim::particle_soa& soa = grid_.elements();
+    tile_wake_.assign(tile_asleep_.size(), 0);
+    for_each_particle([&](const std::uint32_t i) {
+        const bool at_rest = soa.velocity(i).squaredNorm() < max_speed2 && forces_[i].squaredNorm() < max_force2;
+        rest_steps_[i] = at_rest ? (std::min)(rest_steps_[i] + 1, sleep_params_.rest_steps) : 0;
+        if (!at_rest && any_asleep)
+        {
+            for (const std::uint32_t j : grid_.neighbors(i))
             {
-                if ((sorted_elements_[particle_idx].pos - elem.pos).norm() > 1e-6f)
+                const std::uint32_t tile = particle_tiles_[j];
+                if (tile_asleep_[tile])
                 {
-                    neighbors.push_back(sorted_elements_[particle_idx]);
+                    std::atomic_ref<std::uint8_t>(tile_wake_[tile]).store(1, std::memory_order_relaxed);
                 }
-                particle_idx++;
-            } while (particle_idx < sorted_elements_.size() && sorted_elements_[particle_idx].morton == morton);
+            }
+        }
+    });
+
+    // tiles fall asleep at rest, with no velocity and no force left for advance() to see
+    for_each_tile([&](const std::uint32_t tile) {
+        const std::span<const std::uint32_t> particles = grid_.morton_range(tile, tile_costs_.size());
+        const bool at_rest = std::all_of(std::begin(particles), std::end(particles),
+            [&](const std::uint32_t i) { return rest_steps_[i] >= sleep_params_.rest_steps; });
+        if (at_rest)
+        {
+            for (const std::uint32_t i : particles)
+            {
+                soa.set_pos_vel(i, soa.position(i), mth::vec3f_zeros());
+                forces_[i] = mth::vec3f_zeros();
+            }
+            tile_asleep_[tile] = 1;
         }
+    });
 
-        return neighbors;
+    for (std::uint32_t tile = 0; tile < tile_wake_.size(); tile++)
+    {
+        if (tile_wake_[tile])
+        {
+            for (const std::uint32_t i : grid_.morton_range(tile, tile_costs_.size()))
+            {
+                rest_steps_[i] = 0;
+            }
+            tile_asleep_[tile] = 0;
+        }
     }
+    collect_awake_tiles();
 }
 
-sph_sim::sph_sim(const sim::range3_t& block, const std::size_t num_particles, const float h, const float p0, const float k) :
-    grid_(),
-    kernel_(),
-    inv_h_(1.f / h),
-    inv_h_d_(sim::pow<3>(1.f / h)),
-    inv_h_d1_(sim::pow<4>(1.f / h)),
-    h2_(h * h),
-    inv_p0_(1.f / p0),
-    k_(k),
-    mass_(sim::pow<3>(h) * p0),
-    block_(block)
+void sph_sim::density_kernel_sums(const sim::particle_soa& soa)
 {
-    mth::pcg32 rand;
-    const Eigen::Vector3f block_dim = block[1] - block[0];
-    std::vector<sim::particle> particles;
-    particles.reserve(num_particles);
-    for (std::size_t i = 0; i < num_particles; i++)
+    const std::int64_t n = grid_.size();
+    density_sums_.resize(n);
+    if (pair_evaluation_ == sim::pair_evaluation::gather)
     {
-        const Eigen::Vector3f rand3 = Eigen::Vector3f(rand.nextFloat(), rand.nextFloat(), rand.nextFloat());
-        const Eigen::Vector3f point = block[0] + block_dim.cwiseProduct(rand3);
-        particles.emplace_back(point, Eigen::Vector3f::Zero(), 0, 0.f, 0.f);
+        for_each_particle([&](const std::uint32_t i) {
+            density_sums_[i] = density_kernel_sum(i, grid_.neighbors(i), soa);
+        });
+        return;
     }
 
-    grid_ = sim::spatial_hash_table(std::move(particles), h * 2.f);
+    // a block only ever adds to its own particles, so nothing else touches them while it runs. a sleeping block's
+    // mutual pairs are all asleep, its cross pairs are listed from the awake side too
+    for_each_tile([&](const std::uint32_t b) {
+        const std::span<const std::uint32_t> block = grid_.block(b);
+        for (const std::uint32_t i : block)
+        {
+            density_sums_[i] = 0.f;
+        }
+        for (const std::uint32_t i : block)
+        {
+            const float sum = density_kernel_sum(i, grid_.cross_neighbors(i), soa) +
+                density_kernel_scatter(i, grid_.mutual_neighbors(i), soa, density_sums_.data());
+            density_sums_[i] += sum;
+        }
+    });
+}
 
-    float itr = 0.f;
-    for (size_t i = 0; i < kernel_.size(); i++, itr += step)
+void sph_sim::force_kernel_sums(const sim::particle_soa& soa)
+{
+    const std::int64_t n = grid_.size();
+    del_pressures_.resize(n);
+    del2_velocities_.resize(n);
+    if (pair_evaluation_ == sim::pair_evaluation::gather)
     {
-        kernel_[i] = sim::cubic_kernel(itr);
-        dkernel_[i] = sim::dcubic_kernel(itr);
+        for_each_particle([&](const std::uint32_t i) {
+            force_kernel_sum(i, grid_.neighbors(i), soa, del_pressures_[i], del2_velocities_[i]);
+        });
+        return;
     }
+
+    for_each_tile([&](const std::uint32_t b) {
+        const std::span<const std::uint32_t> block = grid_.block(b);
+        for (const std::uint32_t i : block)
+        {
+            del_pressures_[i] = mth::vec3f_zeros();
+            del2_velocities_[i] = mth::vec3f_zeros();
+        }
+        for (const std::uint32_t i : block)
+        {
+            Eigen::Vector3f cross_pressure, cross_velocity, mutual_pressure, mutual_velocity;
+            force_kernel_sum(i, grid_.cross_neighbors(i), soa, cross_pressure, cross_velocity);
+            force_kernel_scatter(i, grid_.mutual_neighbors(i), soa, mutual_pressure, mutual_velocity, del_pressures_.data(), del2_velocities_.data());
+            del_pressures_[i] += cross_pressure + mutual_pressure;
+            del2_velocities_[i] += cross_velocity + mutual_velocity;
+        }
+    });
 }
 
-void sph_sim::update(float dt)
+float sph_sim::density_kernel_sum(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa) const
 {
-    float v_max = 0.f;
+    const sim::kernel_reader particle(soa, i);
+    const float q_scale = inv_h_ * inv_step;
+
+    float sum = 0.f;
+    std::size_t j = 0;
+#if defined(__AVX2__)
+    const __m256 v_q_scale = _mm256_set1_ps(q_scale);
+    const __m256 v_max_sample = _mm256_set1_ps(float(num_kernel_samples - 1));
+    __m256 v_sum = _mm256_setzero_ps();
+    for (; j + 8 <= neighbors.size(); j += 8)
+    {
+        const __m256i v_j = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighbors.data() + j));
+        __m256 dx, dy, dz;
+        particle.position_offsets(v_j, dx, dy, dz);
+        const __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+        const __m256i sample = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(r, v_q_scale), v_max_sample));
+        v_sum = _mm256_add_ps(v_sum, _mm256_i32gather_ps(kernel_.data(), sample, 4));
+    }
+    sum = sim::hsum(v_sum);
+#endif
 
-#pragma omp parallel for
-    for (std::int64_t i = 0; i < grid_.size(); i++)
+    for (; j < neighbors.size(); j++)
+    {
+        const std::uint32_t nj = neighbors[j];
+        float d[3];
+        particle.position_offset(nj, d);
+        const float r = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        sum += kernel_[(std::min)(size_t(r * q_scale), kernel_.size() - 1)];
+    }
+
+    return sum;
+}
+
+void sph_sim::force_kernel_sum(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa,
+    Eigen::Vector3f& del_pressure, Eigen::Vector3f& del2_velocity) const
+{
+    const sim::kernel_reader particle(soa, i);
+    const float pressure_term_i = soa.pressure[i] / (soa.density[i] * soa.density[i]);
+    const float q_scale = inv_h_ * inv_step;
+    const float eps = .01f * h2_;
+    const float min_r = std::numeric_limits<float>::min();
+
+    float dp[3] = { 0.f, 0.f, 0.f };
+    float dv[3] = { 0.f, 0.f, 0.f };
+    std::size_t j = 0;
+#if defined(__AVX2__)
+    const __m256 v_pressure_term_i = _mm256_set1_ps(pressure_term_i);
+    const __m256 v_q_scale = _mm256_set1_ps(q_scale);
+    const __m256 v_max_sample = _mm256_set1_ps(float(num_kernel_samples - 1));
+    const __m256 v_neg_inv_h_d1 = _mm256_set1_ps(-inv_h_d1_);
+    const __m256 v_min_r = _mm256_set1_ps(min_r);
+    const __m256 v_eps = _mm256_set1_ps(eps);
+    const __m256 v_one = _mm256_set1_ps(1.f);
+    __m256 v_dpx = _mm256_setzero_ps(), v_dpy = _mm256_setzero_ps(), v_dpz = _mm256_setzero_ps();
+    __m256 v_dvx = _mm256_setzero_ps(), v_dvy = _mm256_setzero_ps(), v_dvz = _mm256_setzero_ps();
+    for (; j + 8 <= neighbors.size(); j += 8)
     {
-        sim::particle& cur_particle = grid_[i];
-        std::vector<sim::particle> neighbors = grid_.get_neighbors(cur_particle);
+        const __m256i v_j = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighbors.data() + j));
+        __m256 dx, dy, dz;
+        particle.position_offsets(v_j, dx, dy, dz);
+        const __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+        const __m256i sample = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(r, v_q_scale), v_max_sample));
+        const __m256 dkernel = _mm256_i32gather_ps(dkernel_.data(), sample, 4);
+
+        // dWij = dpos / r * -dkernel / h^4, a particle on top of i has dpos 0 and no gradient, min_r keeps that from being 0/0
+        const __m256 grad = _mm256_div_ps(_mm256_mul_ps(dkernel, v_neg_inv_h_d1), _mm256_max_ps(r, v_min_r));
+        const __m256 wx = _mm256_mul_ps(dx, grad), wy = _mm256_mul_ps(dy, grad), wz = _mm256_mul_ps(dz, grad);
+
+        const __m256 inv_density_j = _mm256_div_ps(v_one, _mm256_i32gather_ps(soa.density.data(), v_j, 4));
+        const __m256 pressure_j = _mm256_i32gather_ps(soa.pressure.data(), v_j, 4);
+        const __m256 pressure_term = _mm256_fmadd_ps(pressure_j, _mm256_mul_ps(inv_density_j, inv_density_j), v_pressure_term_i);
+        v_dpx = _mm256_fmadd_ps(wx, pressure_term, v_dpx);
+        v_dpy = _mm256_fmadd_ps(wy, pressure_term, v_dpy);
+        v_dpz = _mm256_fmadd_ps(wz, pressure_term, v_dpz);
+
+        // -(vi - vj) * dpos * dWij / rho_j / (dpos^2 + eps), per component
+        __m256 dvx, dvy, dvz;
+        particle.velocity_offsets(v_j, dvx, dvy, dvz);
+        v_dvx = _mm256_add_ps(v_dvx, _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(dvx, _mm256_mul_ps(dx, wx)), inv_density_j), _mm256_fmadd_ps(dx, dx, v_eps)));
+        v_dvy = _mm256_add_ps(v_dvy, _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(dvy, _mm256_mul_ps(dy, wy)), inv_density_j), _mm256_fmadd_ps(dy, dy, v_eps)));
+        v_dvz = _mm256_add_ps(v_dvz, _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(dvz, _mm256_mul_ps(dz, wz)), inv_density_j), _mm256_fmadd_ps(dz, dz, v_eps)));
+    }
+    dp[0] = sim::hsum(v_dpx); dp[1] = sim::hsum(v_dpy); dp[2] = sim::hsum(v_dpz);
+    dv[0] = sim::hsum(v_dvx); dv[1] = sim::hsum(v_dvy); dv[2] = sim::hsum(v_dvz);
+#endif
 
-        float density = 0.f;
-        for (const sim::particle& neighbor : neighbors)
+    for (; j < neighbors.size(); j++)
+    {
+        const std::uint32_t nj = neighbors[j];
+        float d[3];
+        particle.position_offset(nj, d);
+        const float r = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        const float grad = dkernel_[(std::min)(size_t(r * q_scale), dkernel_.size() - 1)] * -inv_h_d1_ / (std::max)(r, min_r);
+
+        const float inv_density_j = 1.f / soa.density[nj];
+        const float pressure_term = soa.pressure[nj] * inv_density_j * inv_density_j + pressure_term_i;
+        float dvel[3];
+        particle.velocity_offset(nj, dvel);
+        for (std::size_t c = 0; c < 3; c++)
         {
-            const float f_q = sample_kernel_3d((cur_particle.pos - neighbor.pos) * inv_h_);
-            const float Wij = inv_h_d_ * f_q;
+            const float w = d[c] * grad;
+            dp[c] += w * pressure_term;
+            dv[c] += dvel[c] * d[c] * w * inv_density_j / (d[c] * d[c] + eps);
+        }
+    }
 
-            density += mass_ * Wij;
+    del_pressure = Eigen::Vector3f(dp[0], dp[1], dp[2]);
+    del2_velocity = Eigen::Vector3f(dv[0], dv[1], dv[2]);
+}
+
+float sph_sim::density_kernel_scatter(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa, float* sums) const
+{
+    const sim::kernel_reader particle(soa, i);
+    const float q_scale = inv_h_ * inv_step;
+
+    float sum = 0.f;
+    std::size_t j = 0;
+#if defined(__AVX2__)
+    const __m256 v_q_scale = _mm256_set1_ps(q_scale);
+    const __m256 v_max_sample = _mm256_set1_ps(float(num_kernel_samples - 1));
+    __m256 v_sum = _mm256_setzero_ps();
+    alignas(32) float w[8];
+    for (; j + 8 <= neighbors.size(); j += 8)
+    {
+        const __m256i v_j = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighbors.data() + j));
+        __m256 dx, dy, dz;
+        particle.position_offsets(v_j, dx, dy, dz);
+        const __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+        const __m256i sample = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(r, v_q_scale), v_max_sample));
+        const __m256 kernel = _mm256_i32gather_ps(kernel_.data(), sample, 4);
+        v_sum = _mm256_add_ps(v_sum, kernel);
+
+        // no scatter in avx2, the neighbors' halves go out one by one
+        _mm256_store_ps(w, kernel);
+        for (std::size_t k = 0; k < 8; k++)
+        {
+            sums[neighbors[j + k]] += w[k];
         }
+    }
+    sum = sim::hsum(v_sum);
+#endif
 
-        density += mass_ * (2.f / 3.f);
+    for (; j < neighbors.size(); j++)
+    {
+        const std::uint32_t nj = neighbors[j];
+        float d[3];
+        particle.position_offset(nj, d);
+        const float r = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        const float w = kernel_[(std::min)(size_t(r * q_scale), kernel_.size() - 1)];
+        sum += w;
+        sums[nj] += w;
+    }
 
-        cur_particle.density = density;
-        const float pressure = k_ * (sim::pow<7>(density * inv_p0_) - 1.f);
-        cur_particle.pressure = pressure;
+    return sum;
+}
 
-        const float v_mag = cur_particle.vel.norm();
-#pragma omp critical
-        v_max = std::max(v_max, v_mag);
+void sph_sim::force_kernel_scatter(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa,
+    Eigen::Vector3f& del_pressure, Eigen::Vector3f& del2_velocity, Eigen::Vector3f* del_pressures, Eigen::Vector3f* del2_velocities) const
+{
+    const sim::kernel_reader particle(soa, i);
+    const float inv_density_i = 1.f / soa.density[i];
+    const float pressure_term_i = soa.pressure[i] * inv_density_i * inv_density_i;
+    const float q_scale = inv_h_ * inv_step;
+    const float eps = .01f * h2_;
+    const float min_r = std::numeric_limits<float>::min();
+
+    // the pressure term is antisymmetric, the viscosity term only differs by which density it divides by
+    float dp[3] = { 0.f, 0.f, 0.f };
+    float dv[3] = { 0.f, 0.f, 0.f };
+    std::size_t j = 0;
+#if defined(__AVX2__)
+    const __m256 v_pressure_term_i = _mm256_set1_ps(pressure_term_i);
+    const __m256 v_q_scale = _mm256_set1_ps(q_scale);
+    const __m256 v_max_sample = _mm256_set1_ps(float(num_kernel_samples - 1));
+    const __m256 v_neg_inv_h_d1 = _mm256_set1_ps(-inv_h_d1_);
+    const __m256 v_min_r = _mm256_set1_ps(min_r);
+    const __m256 v_eps = _mm256_set1_ps(eps);
+    const __m256 v_one = _mm256_set1_ps(1.f);
+    __m256 v_dpx = _mm256_setzero_ps(), v_dpy = _mm256_setzero_ps(), v_dpz = _mm256_setzero_ps();
+    __m256 v_dvx = _mm256_setzero_ps(), v_dvy = _mm256_setzero_ps(), v_dvz = _mm256_setzero_ps();
+    alignas(32) float pair_dp[3][8];
+    alignas(32) float pair_dv[3][8];
+    for (; j + 8 <= neighbors.size(); j += 8)
+    {
+        const __m256i v_j = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighbors.data() + j));
+        __m256 dx, dy, dz;
+        particle.position_offsets(v_j, dx, dy, dz);
+        const __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+        const __m256i sample = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(r, v_q_scale), v_max_sample));
+        const __m256 dkernel = _mm256_i32gather_ps(dkernel_.data(), sample, 4);
+
+        const __m256 grad = _mm256_div_ps(_mm256_mul_ps(dkernel, v_neg_inv_h_d1), _mm256_max_ps(r, v_min_r));
+        const __m256 wx = _mm256_mul_ps(dx, grad), wy = _mm256_mul_ps(dy, grad), wz = _mm256_mul_ps(dz, grad);
+
+        const __m256 inv_density_j = _mm256_div_ps(v_one, _mm256_i32gather_ps(soa.density.data(), v_j, 4));
+        const __m256 pressure_j = _mm256_i32gather_ps(soa.pressure.data(), v_j, 4);
+        const __m256 pressure_term = _mm256_fmadd_ps(pressure_j, _mm256_mul_ps(inv_density_j, inv_density_j), v_pressure_term_i);
+        const __m256 px = _mm256_mul_ps(wx, pressure_term), py = _mm256_mul_ps(wy, pressure_term), pz = _mm256_mul_ps(wz, pressure_term);
+        v_dpx = _mm256_add_ps(v_dpx, px);
+        v_dpy = _mm256_add_ps(v_dpy, py);
+        v_dpz = _mm256_add_ps(v_dpz, pz);
+
+        __m256 dvx, dvy, dvz;
+        particle.velocity_offsets(v_j, dvx, dvy, dvz);
+        const __m256 sx = _mm256_div_ps(_mm256_mul_ps(dvx, _mm256_mul_ps(dx, wx)), _mm256_fmadd_ps(dx, dx, v_eps));
+        const __m256 sy = _mm256_div_ps(_mm256_mul_ps(dvy, _mm256_mul_ps(dy, wy)), _mm256_fmadd_ps(dy, dy, v_eps));
+        const __m256 sz = _mm256_div_ps(_mm256_mul_ps(dvz, _mm256_mul_ps(dz, wz)), _mm256_fmadd_ps(dz, dz, v_eps));
+        v_dvx = _mm256_fmadd_ps(sx, inv_density_j, v_dvx);
+        v_dvy = _mm256_fmadd_ps(sy, inv_density_j, v_dvy);
+        v_dvz = _mm256_fmadd_ps(sz, inv_density_j, v_dvz);
+
+        _mm256_store_ps(pair_dp[0], px);
+        _mm256_store_ps(pair_dp[1], py);
+        _mm256_store_ps(pair_dp[2], pz);
+        _mm256_store_ps(pair_dv[0], sx);
+        _mm256_store_ps(pair_dv[1], sy);
+        _mm256_store_ps(pair_dv[2], sz);
+        for (std::size_t k = 0; k < 8; k++)
+        {
+            const std::uint32_t nj = neighbors[j + k];
+            del_pressures[nj] -= Eigen::Vector3f(pair_dp[0][k], pair_dp[1][k], pair_dp[2][k]);
+            del2_velocities[nj] -= Eigen::Vector3f(pair_dv[0][k], pair_dv[1][k], pair_dv[2][k]) * inv_density_i;
+        }
     }
-    const float v_cap = 1.f / (dt * inv_h_);
+    dp[0] = sim::hsum(v_dpx); dp[1] = sim::hsum(v_dpy); dp[2] = sim::hsum(v_dpz);
+    dv[0] = sim::hsum(v_dvx); dv[1] = sim::hsum(v_dvy); dv[2] = sim::hsum(v_dvz);
+#endif
 
-#pragma omp parallel for
-    for (std::int64_t i = 0; i < grid_.size(); i++)
+    for (; j < neighbors.size(); j++)
+    {
+        const std::uint32_t nj = neighbors[j];
+        float d[3];
+        particle.position_offset(nj, d);
+        const float r = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        const float grad = dkernel_[(std::min)(size_t(r * q_scale), dkernel_.size() - 1)] * -inv_h_d1_ / (std::max)(r, min_r);
+
+        const float inv_density_j = 1.f / soa.density[nj];
+        const float pressure_term = soa.pressure[nj] * inv_density_j * inv_density_j + pressure_term_i;
+        float dvel[3];
+        particle.velocity_offset(nj, dvel);
+        for (std::size_t c = 0; c < 3; c++)
+        {
+            const float w = d[c] * grad;
+            const float s = dvel[c] * d[c] * w / (d[c] * d[c] + eps);
+            dp[c] += w * pressure_term;
+            dv[c] += s * inv_density_j;
+            del_pressures[nj][c] -= w * pressure_term;
+            del2_velocities[nj][c] -= s * inv_density_i;
+        }
+    }
+
+    del_pressure = Eigen::Vector3f(dp[0], dp[1], dp[2]);
+    del2_velocity = Eigen::Vector3f(dv[0], dv[1], dv[2]);
+}
+
+float sph_sim::boundary_density_sum(const std::size_t i, const sim::particle_soa& soa) const
+{
+    const Eigen::Vector3f pos_i = soa.position(i);
+    const float xi = pos_i.x(), yi = pos_i.y(), zi = pos_i.z();
+    const float q_scale = inv_h_ * inv_step;
+
+    const sim::particle_soa& boundary = boundary_grid_.elements();
+    float sum = 0.f;
+    for (std::uint32_t j = boundary_offsets_[i]; j < boundary_offsets_[i + 1]; j++)
     {
-        sim::particle& cur_particle = grid_[i];
-        std::vector<sim::particle> neighbors = grid_.get_neighbors(cur_particle);
+        const std::uint32_t b = boundary_indices_[j];
+        const float dx = boundary.x[b] - xi, dy = boundary.y[b] - yi, dz = boundary.z[b] - zi;
+        const float r = std::sqrt(dx * dx + dy * dy + dz * dz);
+        sum += boundary_volumes_[b] * kernel_[(std::min)(size_t(r * q_scale), kernel_.size() - 1)];
+    }
+
+    return sum;
+}
 
-        const float density = cur_particle.density;
-        const float inv_density2_i = 1.f / (density * density);
+Eigen::Vector3f sph_sim::boundary_gradient_sum(const std::size_t i, const sim::particle_soa& soa) const
+{
+    const Eigen::Vector3f pos_i = soa.position(i);
+    const float q_scale = inv_h_ * inv_step;
 
-        Eigen::Vector3f del_pressure = mth::vec3f_zeros();
-        Eigen::Vector3f del2_velocity = mth::vec3f_zeros();
-        for (const sim::particle& neighbor : neighbors)
+    const sim::particle_soa& boundary = boundary_grid_.elements();
+    Eigen::Vector3f sum = mth::vec3f_zeros();
+    for (std::uint32_t j = boundary_offsets_[i]; j < boundary_offsets_[i + 1]; j++)
+    {
+        const std::uint32_t b = boundary_indices_[j];
+        const Eigen::Vector3f d = boundary.position(b) - pos_i;
+        const float r = d.norm();
+        if (r > 1e-6f)
         {
-            const float inv_density_j = 1.f / neighbor.density;
-            const float inv_density2_j = inv_density_j * inv_density_j;
-            const Eigen::Vector3f dpos = neighbor.pos - cur_particle.pos;
+            const float grad = dkernel_[(std::min)(size_t(r * q_scale), dkernel_.size() - 1)] * -inv_h_d1_ / r;
+            sum += d * (boundary_volumes_[b] * grad);
+        }
+    }
+
+    return sum;
+}
+
+void sph_sim::update(float dt)
+{
+    compute_forces();
+    integrate(dt);
+}
+
+void sph_sim::publish_snapshot()
+{
+    if (!snapshot_reader_.load(std::memory_order_relaxed))
+    {
+        return;
+    }
 
-            const Eigen::Vector3f dWij = sample_dkernel_3d(dpos * inv_h_) * inv_h_d1_;
-            const Eigen::Vector3f dpressure = dWij * (cur_particle.pressure * inv_density2_i + neighbor.pressure * inv_density2_j);
-            del_pressure = del_pressure + dpressure;
+    const sim::particle_soa& soa = grid_.elements();
+    const std::int64_t n = grid_.size();
+    std::vector<Eigen::Vector3f>& positions = snapshots_.back();
+    positions.resize(n);
+#pragma omp parallel for if(parallel_)
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        positions[i] = soa.position(i);
+    }
+    snapshots_.publish();
+}
 
-            const Eigen::Vector3f dvel = (-(cur_particle.vel - neighbor.vel).cwiseProduct(dpos.cwiseProduct(dWij)) * inv_density_j) / (dpos.cwiseProduct(dpos) + mth::vec3f_replicate(.01f * h2_));
-            del2_velocity = del2_velocity + dvel;
+std::uint32_t sph_sim::advance(const float frame_dt, const sim::substep_params& params)
+{
+    const float h = 1.f / inv_h_;
+    float remaining = frame_dt;
+    std::uint32_t substeps = 0;
+    while (remaining > 0.f && substeps < params.max_substeps)
+    {
+        compute_forces();
+
+        // squared speed and squared force, each thread reduces its own range so there's no lock per particle
+        const sim::particle_soa& soa = grid_.elements();
+        const std::int64_t n = grid_.size();
+        float max_v2 = 0.f, max_f2 = 0.f;
+#pragma omp parallel for if(parallel_) reduction(max : max_v2, max_f2)
+        for (std::int64_t i = 0; i < n; i++)
+        {
+            max_v2 = (std::max)(max_v2, soa.velocity(i).squaredNorm());
+            max_f2 = (std::max)(max_f2, forces_[i].squaredNorm());
+        }
+        // pcisph only adds the pressure forces while integrating, so the largest one of the last solve goes on top.
+        // the particles may have been reordered since, which rules out adding them up per particle
+        const float v_max = std::sqrt(max_v2);
+        const float max_pressure_force = pressure_solver_ == sim::pressure_solver::pcisph ? max_pressure_force_ : 0.f;
+        const float a_max = (std::sqrt(max_f2) + max_pressure_force) / mass_;
+
+        float dt = params.max_dt;
+        if (v_max > 0.f)
+        {
+            dt = (std::min)(dt, params.cfl * h / v_max);
+        }
+        if (a_max > 0.f)
+        {
+            dt = (std::min)(dt, params.force * std::sqrt(h / a_max));
+        }
+        dt = (std::max)(dt, params.min_dt);
 
-            if (std::isnan(del_pressure.x()) || std::isnan(del_pressure.y()) || std::isnan(del_pressure.z())) __debugbreak();
+        // finish the frame within max_substeps, and split the last bit in two instead of leaving a tiny step
+        dt = (std::max)(dt, remaining / float(params.max_substeps - substeps));
+        if (dt >= remaining)
+        {
+            dt = remaining;
+        }
+        else if (dt * 2.f > remaining)
+        {
+            dt = remaining * .5f;
         }
 
-        del_pressure = del_pressure * mass_ * cur_particle.density;
+        integrate(dt);
+        remaining -= dt;
+        substeps++;
+    }
+
+    publish_snapshot();
+    return substeps;
+}
+
+void sph_sim::compute_forces()
+{
+    using clock = std::chrono::steady_clock;
+    const clock::time_point start = clock::now();
+
+    sim::particle_soa& soa = grid_.elements();
+    density_kernel_sums(soa);
+    for_each_particle([&](const std::uint32_t i) {
+        float density = mass_ * inv_h_d_ * density_sums_[i];
+        density += mass_ * (2.f / 3.f);
+        density += inv_h_d_ * boundary_density_sum(i, soa);
+
+        // pcisph solves for pressure later, the force pass only picks up viscosity then
+        const float pressure = pressure_solver_ == sim::pressure_solver::state_equation ? k_ * (sim::pow<7>(density * inv_p0_) - 1.f) : 0.f;
+        soa.density[i] = density;
+        soa.pressure[i] = pressure;
+    });
+
+    const clock::time_point densities_done = clock::now();
+    timings_.density += densities_done - start;
+
+    force_kernel_sums(soa);
+    for_each_particle([&](const std::uint32_t i) {
+        const float density = soa.density[i];
+
+        Eigen::Vector3f del_pressure = del_pressures_[i];
+        const Eigen::Vector3f& del2_velocity = del2_velocities_[i];
+        if (std::isnan(del_pressure.x()) || std::isnan(del_pressure.y()) || std::isnan(del_pressure.z())) __debugbreak();
+
+        del_pressure = del_pressure * mass_ * density;
 
         const Eigen::Vector3f pressure_force = std::abs(density) < 0.00001f ? 
             mth::vec3f_replicate(0.f) : del_pressure * (-mass_ / density);
 
-        static constexpr float viscosity = .001f;
-        const Eigen::Vector3f friction_force = del2_velocity * 2.f * mass_ * mass_ * viscosity;
+        // boundary particles mirror the pressure of the fluid particle, never pulling it in
+        const Eigen::Vector3f boundary_force = std::abs(density) < 0.00001f ?
+            mth::vec3f_replicate(0.f) : boundary_gradient_sum(i, soa) * (-mass_ * (std::max)(0.f, soa.pressure[i]) / (density * density));
+
+        const Eigen::Vector3f friction_force = del2_velocity * 2.f * mass_ * mass_ * viscosity_;
 
         // conventional standard value
         static constexpr float gravity_acc_scalar = 9.80665f;
         static const Eigen::Vector3f gravity_acc = Eigen::Vector3f(0.f, gravity_acc_scalar, 0.f);
         const Eigen::Vector3f gravity_force = gravity_acc * mass_;
 
-        static constexpr float cube_dim = 3.f;
-        static constexpr float k_collision = 1000000.f;
-        //if (cur_particle.pos.y() > ground_height) __debugbreak();
-        const float collision_force_ground = std::max(0.f, cur_particle.pos.y() - cube_dim) * k_collision;
-        const float collision_force_x_wall = (std::max(0.f, cur_particle.pos.x() - cube_dim) + std::min(0.f, cur_particle.pos.x() + cube_dim))* k_collision;
-        const float collision_force_z_wall = (std::max(0.f, cur_particle.pos.z() - cube_dim) + std::min(0.f, cur_particle.pos.z() + cube_dim)) * k_collision;
-        const Eigen::Vector3f collision_force = Eigen::Vector3f(-collision_force_x_wall, -collision_force_ground, -collision_force_z_wall);
+        forces_[i] = pressure_force + boundary_force + gravity_force + friction_force;
+    });
+
+    timings_.force += clock::now() - densities_done;
+}
+
+void sph_sim::solve_pressure(const float dt)
+{
+    using clock = std::chrono::steady_clock;
+    sim::particle_soa& soa = grid_.elements();
+    const std::int64_t n = grid_.size();
+    const float p0 = 1.f / inv_p0_;
+    const float relaxed_delta = pcisph_params_.relaxation * pcisph_delta_ / (dt * dt);
+    const float max_correction = pcisph_params_.max_correction_rate * p0 * dt;
+    predicted_.resize(n);
+    pressure_forces_.resize(n);
+    errors_.resize(n);
+    sim::with_policy(parallel_, [&](const auto& policy) {
+        std::fill(policy, std::begin(pressure_forces_), std::end(pressure_forces_), mth::vec3f_zeros());
+        std::fill(policy, std::begin(predicted_.pressure), std::end(predicted_.pressure), 0.f);
+        std::fill(policy, std::begin(errors_), std::end(errors_), 0.f);
+    });
+
+    // sleeping particles don't get predicted, the awake ones see them as they are
+    for (std::uint32_t tile = 0; tile < tile_asleep_.size(); tile++)
+    {
+        if (tile_asleep_[tile])
+        {
+            for (const std::uint32_t i : grid_.morton_range(tile, tile_asleep_.size()))
+            {
+                predicted_.copy(i, soa, i);
+            }
+        }
+    }
+
+    // particles that start out badly compressed by other fluid particles only aim for max_correction less than they had,
+    // so they get pushed apart over a few steps instead of flung apart in one. compression against the boundary always
+    // gets corrected fully or the fluid would seep through it
+    target_densities_.resize(n);
+    for_each_particle([&](const std::uint32_t i) {
+        const float fluid_density = soa.density[i] - inv_h_d_ * boundary_density_sum(i, soa);
+        target_densities_[i] = (std::max)(p0, fluid_density - max_correction);
+    });
+
+    for (std::uint32_t iteration = 0; iteration < pcisph_params_.max_iterations; iteration++)
+    {
+        for_each_particle([&](const std::uint32_t i) {
+            const Eigen::Vector3f vel = soa.velocity(i) + (forces_[i] + pressure_forces_[i]) * dt / mass_;
+            predicted_.set_pos_vel(i, soa.position(i) + vel * dt, vel);
+        });
+
+        // only compression is corrected, clamping at 0 keeps the free surface from sticking together
+        const clock::time_point start = clock::now();
+        density_kernel_sums(predicted_);
+        for_each_particle([&](const std::uint32_t i) {
+            const float density = mass_ * inv_h_d_ * density_sums_[i] + mass_ * (2.f / 3.f) + inv_h_d_ * boundary_density_sum(i, predicted_);
+            predicted_.density[i] = density;
+            predicted_.pressure[i] = (std::max)(0.f, predicted_.pressure[i] + relaxed_delta * (density - target_densities_[i]));
+            errors_[i] = (std::max)(0.f, density - target_densities_[i]);
+        });
+
+        const float error = sim::with_policy(parallel_, [&](const auto& policy) {
+            return std::reduce(policy, std::begin(errors_), std::end(errors_), 0.f,
+                [](const float a, const float b) { return (std::max)(a, b); });
+        });
+
+        const clock::time_point densities_done = clock::now();
+        timings_.density += densities_done - start;
+
+        force_kernel_sums(predicted_);
+        for_each_particle([&](const std::uint32_t i) {
+            const float density = predicted_.density[i];
+            pressure_forces_[i] = del_pressures_[i] * -(mass_ * mass_) + boundary_gradient_sum(i, predicted_) * (-mass_ * predicted_.pressure[i] / (density * density));
+        });
+        timings_.force += clock::now() - densities_done;
+
+        if (iteration + 1 >= pcisph_params_.min_iterations && error * inv_p0_ < pcisph_params_.tolerance)
+        {
+            break;
+        }
+    }
+
+    for_each_particle([&](const std::uint32_t i) {
+        forces_[i] += pressure_forces_[i];
+        soa.pressure[i] = predicted_.pressure[i];
+    });
+    max_pressure_force_ = std::sqrt(sim::with_policy(parallel_, [&](const auto& policy) {
+        return std::transform_reduce(policy, std::begin(pressure_forces_), std::end(pressure_forces_), 0.f,
+            [](const float a, const float b) { return (std::max)(a, b); }, [](const Eigen::Vector3f& f) { return f.squaredNorm(); });
+    }));
+}
+
+void sph_sim::integrate(const float dt)
+{
+    if (pressure_solver_ == sim::pressure_solver::pcisph)
+    {
+        solve_pressure(dt);
+    }
+
+    // integrate separately so neighbors never see a half updated state
+    sim::particle_soa& soa = grid_.elements();
+    for_each_particle([&](const std::uint32_t i) {
+        Eigen::Vector3f vel = soa.velocity(i) + forces_[i] * dt / mass_;
+        Eigen::Vector3f pos = soa.position(i) + vel * dt;
+
+        // anything the boundary particles didn't stop gets put back on the container wall
+        for (const sim::range3_t& container : containers_)
+        {
+            for (std::size_t axis = 0; axis < 3; axis++)
+            {
+                if (pos[axis] < container[0][axis])
+                {
+                    pos[axis] = container[0][axis];
+                    vel[axis] = (std::max)(0.f, vel[axis]);
+                }
+                else if (pos[axis] > container[1][axis])
+                {
+                    pos[axis] = container[1][axis];
+                    vel[axis] = (std::min)(0.f, vel[axis]);
+                }
+            }
+        }
+        soa.set_pos_vel(i, pos, vel);
 
-        //dt = .4f * 1.f / (inv_h_ * v_max);
-        const Eigen::Vector3f force = pressure_force + gravity_force + friction_force + collision_force; // pressure_force + friction_force + gravity_force + collision_force;
-        cur_particle.vel = cur_particle.vel + force * dt / mass_;
-        cur_particle.pos = cur_particle.pos + cur_particle.vel * dt;
+        if (std::isnan(pos.x()) || std::isnan(pos.y()) || std::isnan(pos.z())) __debugbreak();
+    });
 
-        if (std::isnan(cur_particle.pos.x()) || std::isnan(cur_particle.pos.y()) || std::isnan(cur_particle.pos.z())) __debugbreak();
+    if (sleeping_)
+    {
+        update_sleep();
+    }
+
+    const std::int64_t n = grid_.size();
+    float max_displacement2 = 0.f;
+#pragma omp parallel for if(parallel_) reduction(max : max_displacement2)
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        max_displacement2 = (std::max)(max_displacement2, (soa.position(i) - list_positions_[i]).squaredNorm());
     }
 
-    grid_.update();
+    // new emitters and sinks get applied right away, and an empty sim has nothing that could move
+    const float half_skin = skin_ * .5f;
+    const bool flow = !emitters_.empty() || !sinks_.empty();
+    if (skin_ <= 0.f || max_displacement2 > half_skin * half_skin || flow_changed_ || (flow && grid_.size() == 0))
+    {
+        using clock = std::chrono::steady_clock;
+        const clock::time_point start = clock::now();
+        const bool reordered = flow ? update_flow(std::sqrt(max_displacement2)) : grid_.update();
+        flow_changed_ = false;
+        const clock::time_point grid_done = clock::now();
+        rebuild_neighbors(reordered);
+        timings_.grid += grid_done - start;
+        timings_.neighbors += clock::now() - grid_done;
+    }
+    timings_.steps++;
 }
 
-draw_item sph_sim::draw_item(rhi::device* device, rhi::buffer* d_mvp_buf)
+#if !defined(XS_HEADLESS)
+draw_item sph_sim::draw_item(rhi::device* device, rhi::buffer* d_mvp_buf, const std::size_t max_particles)
 {
     const render_pass& skinned_pass = render_pass_registry::get().pass("simple_points");
 
-    d_verts_buf_ = device->create_buffer_unique(rhi::buffer_type::vertex, grid_.size() * sizeof(Eigen::Vector3f), nullptr);
-    
-    d_verts_view_ = device->map_buffer<Eigen::Vector3f>(d_verts_buf_.get(), 0, grid_.size());
+    // the sim changes size with emitters and sinks, so the buffer is as big as it may get. until the first snapshot
+    // comes in every point is nan
+    max_drawn_ = max_particles;
+    drawn_particles_ = max_particles;
+    d_verts_buf_ = device->create_buffer_unique(rhi::buffer_type::vertex, max_particles * sizeof(Eigen::Vector3f), nullptr);
+    d_verts_view_ = device->map_buffer<Eigen::Vector3f>(d_verts_buf_.get(), 0, max_particles);
+    std::fill_n(d_verts_view_.data(), max_particles, Eigen::Vector3f::Constant(std::numeric_limits<float>::quiet_NaN()));
+    // the sim thread publishes from its next frame on
+    snapshot_reader_.store(true, std::memory_order_relaxed);
 
     d_mvp_uniforms_ = skinned_pass.uniform_set_builder(device, 0)
         .uniform("mvp", { d_mvp_buf })
         .produce();
 
     return skinned_pass.draw_item_builder()
-        .elem_count(grid_.size())
+        .elem_count(max_particles)
         .vertex_buffers({ d_verts_buf_.get() })
         .uniform_sets({ {0, d_mvp_uniforms_.get()} })
         .update([this](rhi::device*) {
-            std::transform(std::begin(grid_.sorted_elements_), std::end(grid_.sorted_elements_), std::begin(d_verts_view_), [](const sim::particle& p) { return p.pos; });
+            // never touches the particles, the sim can be halfway through a step on its own thread
+            if (!snapshots_.fetch())
+            {
+                return;
+            }
+
+            const std::vector<Eigen::Vector3f>& positions = snapshots_.front();
+            const std::size_t drawn = (std::min)(positions.size(), max_drawn_);
+            std::memcpy(d_verts_view_.data(), positions.data(), drawn * sizeof(Eigen::Vector3f));
+            if (drawn < drawn_particles_)
+            {
+                std::fill(d_verts_view_.data() + drawn, d_verts_view_.data() + drawn_particles_,
+                    Eigen::Vector3f::Constant(std::numeric_limits<float>::quiet_NaN()));
+            }
+            drawn_particles_ = drawn;
         })
         .produce_draw();
 }
+#endif
 
 void sph_sim::reset()
 {
-    mth::pcg32 rand;
+    mth::pcg32 rng = rand_;
     const Eigen::Vector3f block_dim = block_[1] - block_[0];
     std::vector<sim::particle> particles;
-    particles.reserve(grid_.size());
-    for (std::size_t i = 0; i < grid_.size(); i++)
+    particles.reserve(initial_size_);
+    for (std::size_t i = 0; i < initial_size_; i++)
     {
-        const Eigen::Vector3f rand3 = Eigen::Vector3f(rand.nextFloat(), rand.nextFloat(), rand.nextFloat());
+        const Eigen::Vector3f rand3 = Eigen::Vector3f(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
         const Eigen::Vector3f point = block_[0] + block_dim.cwiseProduct(rand3);
         particles.emplace_back(point, Eigen::Vector3f::Zero(), 0, 0.f, 0.f);
     }
 
-    grid_ = sim::spatial_hash_table(std::move(particles), 2.f / inv_h_);
+    grid_ = sim::spatial_hash_table(std::move(particles), 2.f / inv_h_ + skin_, grid_backend_, reorder_);
+    grid_.set_parallel(parallel_);
+    forces_.assign(grid_.size(), mth::vec3f_zeros());
+    rest_steps_.clear();
+    rebuild_neighbors(true);
+}
+
+void sph_sim::save_checkpoint(const std::string& filename) const
+{
+    // the derived constants are saved as they are, recomputing them from h and p0 could round differently
+    const sph_checkpoint_params params = {
+        .inv_h = inv_h_, .inv_h_d = inv_h_d_, .inv_h_d1 = inv_h_d1_, .h2 = h2_,
+        .inv_p0 = inv_p0_, .k = k_, .mass = mass_, .skin = skin_,
+        .pcisph_delta = pcisph_delta_,
+        .max_pressure_force = max_pressure_force_,
+        .backend = grid_backend_,
+        .pressure_solver = pressure_solver_,
+        .pair_evaluation = pair_evaluation_,
+        .reorder = reorder_,
+        .pcisph = pcisph_params_,
+        .block = { to_array(block_[0]), to_array(block_[1]) },
+        .sleeping = sleeping_,
+        .sleep = sleep_params_,
+        .viscosity = viscosity_,
+        .initial_size = initial_size_
+    };
+
+    checkpoint::writer file(checkpoint::kind::sph_sim);
+    file.add_value(params_tag, params);
+    file.add_value(rng_tag, rand_);
+    std::vector<sim::particle> particles;
+    copy_particles(particles);
+    file.add(particles_tag, std::span<const sim::particle>(particles));
+    file.add(boundary_samples_tag, std::span(boundary_samples_));
+    file.add(containers_tag, std::span(containers_));
+    file.add(emitters_tag, std::span(emitters_));
+    file.add(sinks_tag, std::span(sinks_));
+    if (sleeping_)
+    {
+        file.add(rest_steps_tag, std::span(rest_steps_));
+    }
+    file.write(filename);
+}
+
+std::unique_ptr<sph_sim> sph_sim::load_checkpoint(const std::string& filename)
+{
+    const checkpoint::reader file(filename, checkpoint::kind::sph_sim);
+    const sph_checkpoint_params params = file.value<sph_checkpoint_params>(params_tag);
+
+    std::unique_ptr<sph_sim> restored(new sph_sim());
+    restored->inv_h_ = params.inv_h;
+    restored->inv_h_d_ = params.inv_h_d;
+    restored->inv_h_d1_ = params.inv_h_d1;
+    restored->h2_ = params.h2;
+    restored->inv_p0_ = params.inv_p0;
+    restored->k_ = params.k;
+    restored->mass_ = params.mass;
+    restored->skin_ = params.skin;
+    restored->pcisph_delta_ = params.pcisph_delta;
+    restored->max_pressure_force_ = params.max_pressure_force;
+    restored->grid_backend_ = params.backend;
+    restored->pressure_solver_ = params.pressure_solver;
+    restored->pair_evaluation_ = params.pair_evaluation;
+    restored->reorder_ = params.reorder;
+    restored->pcisph_params_ = params.pcisph;
+    restored->block_ = { to_vector3f(params.block[0]), to_vector3f(params.block[1]) };
+    restored->sleeping_ = params.sleeping;
+    restored->sleep_params_ = params.sleep;
+    restored->viscosity_ = params.viscosity;
+    restored->initial_size_ = params.initial_size;
+    restored->rand_ = file.value<mth::pcg32>(rng_tag);
+
+    // the particles come straight out of the mapping, density and pressure included so the first step's forces match
+    const std::span<const sim::particle> particles = file.get<sim::particle>(particles_tag);
+    restored->grid_ = sim::spatial_hash_table(to_vector(particles), 2.f / restored->inv_h_ + restored->skin_, restored->grid_backend_, restored->reorder_);
+    restored->grid_.set_parallel(restored->parallel_);
+    restored->forces_.assign(particles.size(), mth::vec3f_zeros());
+    if (params.sleeping)
+    {
+        // saved in the old order, the grid just sorted the particles
+        restored->rest_steps_ = to_vector(file.get<std::uint32_t>(rest_steps_tag));
+        if (restored->rest_steps_.size() != particles.size())
+        {
+            throw std::runtime_error("checkpoint sections don't match up");
+        }
+        restored->gather_rest_steps();
+    }
+
+    // rebuilds the boundary grid, the boundary volumes and every neighbor list
+    restored->boundary_samples_ = to_vector(file.get<Eigen::Vector3f>(boundary_samples_tag));
+    restored->containers_ = to_vector(file.get<sim::range3_t>(containers_tag));
+    restored->sinks_ = to_vector(file.get<sim::range3_t>(sinks_tag));
+    for (const sim::emitter& emitter : file.get<sim::emitter>(emitters_tag))
+    {
+        restored->emitters_.push_back(emitter);
+        restored->sample_emitter(emitter);
+    }
+    restored->build_boundary();
+    return restored;
+}
+
+sph_ensemble::sph_ensemble(const sim::range3_t& block, const std::size_t num_particles, const float h,
+    const std::vector<member_params>& members, const float skin,
+    const sim::grid_backend backend, const sim::reorder_policy& reorder, const mth::pcg32& rand, const std::optional<sim::range3_t>& container) :
+    params_(members),
+    members_(members.size()),
+    substeps_(members.size(), 0)
+{
+    const std::int64_t n = std::int64_t(members.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (std::int64_t i = 0; i < n; i++)
+    {
+        const member_params& params = params_[i];
+        std::unique_ptr<sph_sim> member = std::make_unique<sph_sim>(block, num_particles, h, params.p0, params.k, skin, backend, reorder, rand, container);
+        member->set_viscosity(params.viscosity);
+        // the whole step runs inline on the thread stepping the member, the parallelism is across members
+        member->set_scheduler(std::make_shared<sim::tile_scheduler>(1));
+        members_[i] = std::move(member);
+    }
+}
+
+void sph_ensemble::update(const float dt)
+{
+    for_each_member([dt](const std::size_t, sph_sim& member) {
+        member.update(dt);
+    });
+}
+
+std::span<const std::uint32_t> sph_ensemble::advance(const float frame_dt, const sim::substep_params& params)
+{
+    for_each_member([&](const std::size_t i, sph_sim& member) {
+        substeps_[i] = member.advance(frame_dt, params);
+    });
+    return substeps_;
 }
 
-}
\ No newline at end of file
+void sph_ensemble::reset()
+{
+    for_each_member([](const std::size_t, sph_sim& member) {
+        member.reset();
+    });
+}
+
+}
@@ -1,13 +1,31 @@
-﻿#include <array>
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <execution>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <new>
+#include <optional>
+#include <span>
+#include <string>
 #include <unordered_set>
 
 #include "math/math.hpp"
 #include "math/pcg32.hpp"
+
+// headless builds (the sim benchmark) leave out everything that needs a device
+#if !defined(XS_HEADLESS)
 #include "rhi/rhi.hpp"
 #include "draw_item.hpp"
 #include "renderer.hpp"
+#endif
 
 namespace xs
 {
@@ -17,6 +35,86 @@ namespace xs
 		using size2_t = std::array<std::size_t, 2>; // TODO: move out sometime
 		using size3_t = std::array<std::uint32_t, 3>;
 		using range3_t = std::array<Eigen::Vector3f, 2>;
+
+		template<typename T, std::size_t alignment>
+		struct aligned_allocator
+		{
+			using value_type = T;
+
+			template<typename U>
+			struct rebind { using other = aligned_allocator<U, alignment>; };
+
+			aligned_allocator() = default;
+			template<typename U>
+			aligned_allocator(const aligned_allocator<U, alignment>&) {}
+
+			T* allocate(const std::size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignment))); }
+			void deallocate(T* ptr, const std::size_t) { ::operator delete(ptr, std::align_val_t(alignment)); }
+
+			friend bool operator==(const aligned_allocator&, const aligned_allocator&) { return true; }
+		};
+
+		template<typename T>
+		using aligned_vector = std::vector<T, aligned_allocator<T, 32>>;
+
+		// x, y and z in their own 32 byte aligned channels for the simd loops
+		struct vec3_channels
+		{
+			inline void resize(const std::size_t n, const Eigen::Vector3f& v)
+			{
+				x.resize(n, v.x()); y.resize(n, v.y()); z.resize(n, v.z());
+			}
+
+			inline void assign(const std::span<const Eigen::Vector3f> vectors)
+			{
+				resize(vectors.size(), Eigen::Vector3f::Zero());
+				for (std::size_t i = 0; i < vectors.size(); i++)
+				{
+					set(i, vectors[i]);
+				}
+			}
+
+			inline std::vector<Eigen::Vector3f> to_vectors() const
+			{
+				std::vector<Eigen::Vector3f> vectors(size());
+				for (std::size_t i = 0; i < size(); i++)
+				{
+					vectors[i] = get(i);
+				}
+				return vectors;
+			}
+
+			inline Eigen::Vector3f get(const std::size_t i) const { return Eigen::Vector3f(x[i], y[i], z[i]); }
+			inline void set(const std::size_t i, const Eigen::Vector3f& v) { x[i] = v.x(); y[i] = v.y(); z[i] = v.z(); }
+			inline void add(const std::size_t i, const Eigen::Vector3f& v) { x[i] += v.x(); y[i] += v.y(); z[i] += v.z(); }
+			inline std::size_t size() const { return x.size(); }
+
+			aligned_vector<float> x, y, z;
+		};
+
+		enum class cloth_integrator : std::uint8_t
+		{
+			symplectic_euler, // explicit, stiff springs need steps of about a millisecond
+			implicit_euler, // backward euler linearized once per step (baraff-witkin), stable at frame sized steps
+			xpbd // springs become distance constraints solved on positions, stable at any step and stiffness
+		};
+
+		struct implicit_params
+		{
+			float tolerance = 1e-3f; // residual of the velocity change solve relative to the right hand side
+			std::uint32_t max_iterations = 100;
+		};
+
+		// a step costs substeps * iterations sweeps over the constraints whatever the motion. compliance is the inverse
+		// stiffness, 0 is rigid
+		struct xpbd_params
+		{
+			std::uint32_t substeps = 8;
+			std::uint32_t iterations = 2;
+			float stretch_compliance = 0.f;
+			float bending_compliance = 1e-3f;
+			bool bending = true;
+		};
 	}
 
 class cloth
@@ -27,12 +125,23 @@ public:
 
 	void update(float dt);
 
+#if !defined(XS_HEADLESS)
 	draw_item draw_item(rhi::device* device, rhi::buffer* d_mvp_buf);
+#endif
 
 	void set_wind(const Eigen::Vector3f& v_wind) { v_wind_ = v_wind; }
-	void release() { fixed_.clear(); }
+	void set_springs(const float k_spring, const float k_damping) { k_spring_ = k_spring; k_damping_ = k_damping; }
+	void set_integrator(const sim::cloth_integrator integrator, const sim::implicit_params& params = {}) { integrator_ = integrator; implicit_params_ = params; }
+	void set_xpbd_params(const sim::xpbd_params& params) { xpbd_params_ = params; }
+	void release() { fixed_.clear(); update_inv_masses(); }
+
+	// whole state including the springs and pins to a versioned binary file (see checkpoint.hpp), restoring it picks
+	// the sim up exactly where it was. both throw std::runtime_error
+	void save_checkpoint(const std::string& filename) const;
+	static std::unique_ptr<cloth> load_checkpoint(const std::string& filename);
 
 private:
+	cloth() = default;
 
 	struct spring_damper
 	{
@@ -40,27 +149,89 @@ private:
 		float dist;
 	};
 
-	std::vector<Eigen::Vector3f> forces_;
+	// 3x3 blocks in compressed rows, a row per vertex. the pattern only depends on the springs so it gets built once
+	// and every step just refills the blocks
+	struct block_matrix
+	{
+		std::vector<std::uint32_t> row_offsets;
+		std::vector<std::uint32_t> columns;
+		std::vector<std::uint32_t> diagonal; // slot of the diagonal block of every row
+		std::vector<Eigen::Matrix3f> blocks;
+	};
+
+	// constraint indices in batches that don't share a vertex, so each batch can scatter into its verts in parallel.
+	// the constraints themselves stay where they are
+	void color_constraints(const std::vector<spring_damper>& constraints, std::vector<std::uint32_t>& order, std::vector<std::size_t>& batches) const;
+	// xpbd bending, see the definition
+	void build_bending_constraints();
+	// csr of the triangles around every vertex, so the per-vertex sums of the triangle passes are gathers
+	void build_vertex_triangles();
+	// same for the springs, so the explicit spring forces are a gather as well
+	void build_vertex_springs();
+	void update_inv_masses();
+
+	void build_implicit_pattern();
+	// spring forces into forces_ along with the system for the velocity change, into system_ and rhs_
+	void assemble_implicit(const float dt);
+	// preconditioned conjugate gradient on system_ starting from the last dv_, pinned verts are filtered out of every
+	// direction so they keep their velocity. leaves the velocity change in dv_
+	void solve_implicit();
+	// moves verts_ and velocities_ a whole step, forces_ only has the external forces
+	void solve_xpbd(const float dt);
+	// v += f dt / m and x += v dt over the whole channels, then the ground plane leaves the forces for the next step
+	void integrate_vertices(const float dt, const bool apply_forces, const bool move);
+
+	sim::vec3_channels forces_;
 	std::vector<spring_damper> spring_dampers_;
-	std::vector<Eigen::Vector3f> velocities_;
-	std::vector<Eigen::Vector3f> verts_;
+	std::vector<std::uint32_t> spring_order_; // spring indices batch by batch
+	std::vector<std::size_t> spring_colors_; // offsets of the batches into spring_order_
+	std::vector<spring_damper> bending_; // damping isn't used, they only constrain distance
+	std::vector<std::uint32_t> bending_order_;
+	std::vector<std::size_t> bending_colors_;
+	sim::vec3_channels velocities_;
+	sim::vec3_channels verts_;
 	std::vector<Eigen::Vector4f> tri_norms_;
 	std::vector<Eigen::Vector3f> norms_;
 	std::vector<sim::size3_t> inds_;
+	std::vector<std::uint32_t> vertex_triangle_offsets_; // count, scan, fill of the triangles of every vertex
+	std::vector<std::uint32_t> vertex_triangles_; // ascending per vertex, so the gathers add in the old scatter order
+	std::vector<Eigen::Vector3f> tri_forces_; // aero force of every triangle, same on all three verts
+	std::vector<std::uint32_t> vertex_spring_offsets_;
+	std::vector<std::uint32_t> vertex_springs_; // spring index * 2 + which end, ascending per vertex like the triangles
+	std::vector<Eigen::Vector4f> spring_forces_; // direction and magnitude of every explicit spring force on its i0 end
 	std::vector<std::size_t> fixed_;
+	sim::aligned_vector<float> inv_masses_; // 0 for the fixed verts, so pinning costs nothing in the loops
+
+	sim::cloth_integrator integrator_;
+	sim::implicit_params implicit_params_;
+	sim::xpbd_params xpbd_params_;
+	block_matrix system_;
+	std::vector<std::array<std::uint32_t, 2>> spring_slots_; // of the (i0, i1) and (i1, i0) blocks of every spring
+	std::vector<Eigen::Matrix3f> inv_diagonal_;
+	std::vector<Eigen::Vector3f> rhs_;
+	std::vector<Eigen::Vector3f> dv_; // kept between steps as the first guess
+	std::vector<Eigen::Vector3f> residual_;
+	std::vector<Eigen::Vector3f> direction_;
+	std::vector<Eigen::Vector3f> preconditioned_;
+	std::vector<Eigen::Vector3f> product_;
+	std::vector<Eigen::Vector3f> predicted_;
+	std::vector<float> lambdas_; // springs then bending
 
+#if !defined(XS_HEADLESS)
 	rhi::device::scoped_mmap<Eigen::Vector3f> d_vert_pos_view_;
 	rhi::device::scoped_mmap<Eigen::Vector3f> d_vert_norm_view_;
 	rhi::device::ptr<rhi::uniform_set> d_mvp_uniforms_;
 	rhi::device::ptr<rhi::buffer> d_vert_pos_buf_;
 	rhi::device::ptr<rhi::buffer> d_vert_norm_buf_;
 	rhi::device::ptr<rhi::buffer> d_inds_buf_;
+#endif
 
 	Eigen::Vector3f v_wind_;
 	float k_spring_;
 	float k_damping_;
 };
 
+#if !defined(XS_HEADLESS)
 // doesn't work
 class mpm_sim
 {
@@ -95,6 +266,7 @@ private:
 	rhi::device::ptr<rhi::buffer> d_m_buf_;
 	rhi::device::ptr<rhi::buffer> d_grid_metrics_buf_;
 };
+#endif
 
 namespace sim
 {
@@ -216,7 +388,7 @@ namespace sim
 		answer = morton256_z[(z >> 16) & 0xFF] | // we start by shifting the third byte, since we only look at the first 21 bits
 			morton256_y[(y >> 16) & 0xFF] |
 			morton256_x[(x >> 16) & 0xFF];
-		answer = answer << 48 | morton256_z[(z >> 8) & 0xFF] | // shifting second byte
+		answer = answer << 24 | morton256_z[(z >> 8) & 0xFF] | // shifting second byte
 			morton256_y[(y >> 8) & 0xFF] |
 			morton256_x[(x >> 8) & 0xFF];
 		answer = answer << 24 |
@@ -226,6 +398,23 @@ namespace sim
 		return answer;
 	}
 
+	// every third bit of v packed together, the inverse of the tables above
+	static inline uint32_t morton_compact(uint64_t v)
+	{
+		v &= 0x1249249249249249ull;
+		v = (v ^ (v >> 2)) & 0x30c30c30c30c30c3ull;
+		v = (v ^ (v >> 4)) & 0xf00f00f00f00f00full;
+		v = (v ^ (v >> 8)) & 0x00ff0000ff0000ffull;
+		v = (v ^ (v >> 16)) & 0xffff00000000ffffull;
+		v = (v ^ (v >> 32)) & 0x00000000001fffffull;
+		return uint32_t(v);
+	}
+
+	static inline size3_t morton_decode(const uint64_t code)
+	{
+		return size3_t{ morton_compact(code), morton_compact(code >> 1), morton_compact(code >> 2) };
+	}
+
 	// from pbrt
 	template <int n>
 	static constexpr float pow(float v) {
@@ -246,7 +435,78 @@ namespace sim
 		float pressure;
 	};
 
-	// TODO: store particle references instead of full particles, sort full particles every 100 ticks
+	// fn(policy) with std::execution::par, or with seq for a sim that gets stepped on one thread
+	template<typename Fn>
+	inline decltype(auto) with_policy(const bool parallel, Fn&& fn)
+	{
+		return parallel ? fn(std::execution::par) : fn(std::execution::seq);
+	}
+
+	// the particle state as structure of arrays, which is how the grid stores its elements and the simd kernels read
+	// them. every channel is 32 byte aligned. particle is only what goes in and out, morton codes are kept by the grid
+	struct particle_soa
+	{
+		void resize(const std::size_t n);
+		void gather(const std::vector<particle>& particles);
+
+		inline void set_pos_vel(const std::size_t i, const Eigen::Vector3f& pos, const Eigen::Vector3f& vel)
+		{
+			x[i] = pos.x(); y[i] = pos.y(); z[i] = pos.z();
+			vx[i] = vel.x(); vy[i] = vel.y(); vz[i] = vel.z();
+		}
+
+		inline void set(const std::size_t i, const particle& p)
+		{
+			set_pos_vel(i, p.pos, p.vel);
+			density[i] = p.density;
+			pressure[i] = p.pressure;
+		}
+
+		// element i of this from element j of from
+		inline void copy(const std::size_t i, const particle_soa& from, const std::size_t j)
+		{
+			x[i] = from.x[j]; y[i] = from.y[j]; z[i] = from.z[j];
+			vx[i] = from.vx[j]; vy[i] = from.vy[j]; vz[i] = from.vz[j];
+			density[i] = from.density[j];
+			pressure[i] = from.pressure[j];
+		}
+
+		inline Eigen::Vector3f position(const std::size_t i) const { return Eigen::Vector3f(x[i], y[i], z[i]); }
+		inline Eigen::Vector3f velocity(const std::size_t i) const { return Eigen::Vector3f(vx[i], vy[i], vz[i]); }
+		inline std::size_t size() const { return x.size(); }
+
+		aligned_vector<float> x, y, z;
+		aligned_vector<float> vx, vy, vz;
+		aligned_vector<float> density;
+		aligned_vector<float> pressure;
+	};
+
+	enum class grid_backend : std::uint8_t
+	{
+		hash, // unordered_map from the morton code of a cell to its first element
+		dense // cell_start/cell_end arrays over the bounding box of the elements, exact
+	};
+
+	// when update() physically moves the elements into morton order, the rest of the time it only sorts order_
+	struct reorder_policy
+	{
+		std::uint32_t period = 1; // reorder every period updates, 1 keeps the elements sorted every update
+		float max_scatter = 1.f; // also reorder once this fraction of morton neighbors are far apart in memory
+	};
+
+	// results of the spatial_hash_table queries
+	struct query_hit
+	{
+		std::uint32_t index;
+		float distance2;
+	};
+
+	struct ray_hit
+	{
+		std::uint32_t index;
+		float t;
+	};
+
 	// TODO: better incremental sorting algorithm: insertion or merge sort
 	// TODO: move sketch simd stuff into meth
 	class spatial_hash_table
@@ -266,20 +526,291 @@ namespace sim
 			return sim::size3_t{ as_int[0] + sign_flip, as_int[1] + sign_flip, as_int[2] + sign_flip };
 		}
 
-		inline uint64_t hash_coord(const Eigen::Vector3f& p, const sim::size3_t offset = { 0,0,0 }) const
+		// hash table key of the cell p + offset is in, its morton code. every element of the cell has it and no two
+		// cells share it, unlike a hash of the coords
+		inline uint64_t cell_key(const Eigen::Vector3f& p, const sim::size3_t offset = { 0,0,0 }) const
 		{
-			static const sim::size3_t magic = sim::size3_t{ 73856093, 19349663, 83492791 };
 			const sim::size3_t uint_space = to_uint_space(p);
-			const sim::size3_t added = { uint_space[0] + offset[0], uint_space[1] + offset[1], uint_space[2] + offset[2] };
-			const sim::size3_t multiplied = { added[0] * magic[0], added[1] * magic[1], added[2] * magic[2] };
-			return multiplied[0] ^ multiplied[1] ^ multiplied[2];
+			return morton_encode(uint_space[0] + offset[0], uint_space[1] + offset[1], uint_space[2] + offset[2]);
+		}
+
+		// coords of the dense grid cell containing p, components are >= dense_dims_ if p is outside the grid
+		inline sim::size3_t to_dense_space(const Eigen::Vector3f& p) const
+		{
+			const sim::size3_t uint_space = to_uint_space(p);
+			return sim::size3_t{ (uint_space[0] >> dense_level_) - dense_min_[0], (uint_space[1] >> dense_level_) - dense_min_[1],
+				(uint_space[2] >> dense_level_) - dense_min_[2] };
+		}
+
+		inline std::size_t dense_cell_index(const sim::size3_t& c) const
+		{
+			return (std::size_t(c[2]) * dense_dims_[1] + c[1]) * dense_dims_[0] + c[0];
+		}
+
+		// calls fn(idx) with the element index of everything in the 3x3x3 block of cells around p
+		template<typename Fn>
+		inline void visit_cell_neighborhood(const Eigen::Vector3f& p, Fn&& fn) const
+		{
+			if (backend_ == grid_backend::dense)
+			{
+				const sim::size3_t c = to_dense_space(p);
+				for (std::int32_t dz = -1; dz <= 1; dz++)
+				{
+					for (std::int32_t dy = -1; dy <= 1; dy++)
+					{
+						for (std::int32_t dx = -1; dx <= 1; dx++)
+						{
+							const sim::size3_t nc = { c[0] + std::uint32_t(dx), c[1] + std::uint32_t(dy), c[2] + std::uint32_t(dz) };
+							if (nc[0] >= dense_dims_[0] || nc[1] >= dense_dims_[1] || nc[2] >= dense_dims_[2])
+							{
+								continue;
+							}
+
+							const std::size_t cell = dense_cell_index(nc);
+							for (std::uint32_t idx = cell_start_[cell]; idx < cell_end_[cell]; idx++)
+							{
+								fn(std::size_t(order_[idx]));
+							}
+						}
+					}
+				}
+				return;
+			}
+
+			for (std::int32_t dz = -1; dz <= 1; dz++)
+			{
+				for (std::int32_t dy = -1; dy <= 1; dy++)
+				{
+					for (std::int32_t dx = -1; dx <= 1; dx++)
+					{
+						const auto cell_itr = grid_table_.find(cell_key(p, { std::uint32_t(dx), std::uint32_t(dy), std::uint32_t(dz) }));
+						if (cell_itr == std::end(grid_table_))
+						{
+							continue;
+						}
+
+						std::size_t idx = cell_itr->second;
+						const uint64_t morton = mortons_[order_[idx]];
+						do
+						{
+							fn(std::size_t(order_[idx]));
+							idx++;
+						} while (idx < order_.size() && mortons_[order_[idx]] == morton);
+					}
+				}
+			}
+		}
+
+		// calls fn(idx) with the element index of everything in the cells of the inclusive uint space range [lo, hi],
+		// every element once. returns false without calling fn if the range has more cells than there are elements
+		template<typename Fn>
+		inline bool visit_cells(const sim::size3_t& lo, const sim::size3_t& hi, Fn&& fn) const
+		{
+			if (backend_ == grid_backend::dense)
+			{
+				// a coarse cell covers several uint space cells, so the range gets cut down to the coarse cells first
+				sim::size3_t dense_lo, dense_hi;
+				for (std::size_t axis = 0; axis < 3; axis++)
+				{
+					const std::uint32_t l = lo[axis] >> dense_level_, h = hi[axis] >> dense_level_;
+					if (h < dense_min_[axis] || l >= dense_min_[axis] + dense_dims_[axis])
+					{
+						return true;
+					}
+					dense_lo[axis] = (std::max)(l, dense_min_[axis]) - dense_min_[axis];
+					dense_hi[axis] = (std::min)(h - dense_min_[axis], dense_dims_[axis] - 1);
+				}
+
+				const std::uint64_t cells = std::uint64_t(dense_hi[0] - dense_lo[0] + 1) * (dense_hi[1] - dense_lo[1] + 1) * (dense_hi[2] - dense_lo[2] + 1);
+				if (cells > size())
+				{
+					return false;
+				}
+
+				for (std::uint32_t z = dense_lo[2]; z <= dense_hi[2]; z++)
+				{
+					for (std::uint32_t y = dense_lo[1]; y <= dense_hi[1]; y++)
+					{
+						for (std::uint32_t x = dense_lo[0]; x <= dense_hi[0]; x++)
+						{
+							const std::size_t cell = dense_cell_index({ x, y, z });
+							for (std::uint32_t idx = cell_start_[cell]; idx < cell_end_[cell]; idx++)
+							{
+								fn(order_[idx]);
+							}
+						}
+					}
+				}
+				return true;
+			}
+
+			const std::uint64_t cells = std::uint64_t(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+			if (cells > size())
+			{
+				return false;
+			}
+
+			for (std::uint32_t z = lo[2]; z <= hi[2]; z++)
+			{
+				for (std::uint32_t y = lo[1]; y <= hi[1]; y++)
+				{
+					for (std::uint32_t x = lo[0]; x <= hi[0]; x++)
+					{
+						const uint64_t morton = morton_encode(x, y, z);
+						const auto cell_itr = grid_table_.find(morton);
+						if (cell_itr == std::end(grid_table_))
+						{
+							continue;
+						}
+
+						std::size_t idx = cell_itr->second;
+						do
+						{
+							fn(order_[idx]);
+							idx++;
+						} while (idx < order_.size() && mortons_[order_[idx]] == morton);
+					}
+				}
+			}
+			return true;
+		}
+
+		// walks the uint space cells the segment origin + dir * [0, max_t] passes through in order, dir normalized.
+		// fn(cell, t0, t1) gets the stretch of the segment inside the cell and returns false to stop
+		template<typename Fn>
+		inline void march_cells(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, const float max_t, Fn&& fn) const
+		{
+			// cells truncate towards 0 (the one at 0 is two wide), so the wall a cell is left through depends on its side
+			static constexpr std::int64_t sign_flip = std::numeric_limits<int32_t>::max();
+			sim::size3_t cell = to_uint_space(origin);
+			const auto exit_t = [&](const std::size_t axis) {
+				if (dir[axis] == 0.f)
+				{
+					return std::numeric_limits<float>::infinity();
+				}
+				const std::int64_t i = std::int64_t(cell[axis]) - sign_flip;
+				const std::int64_t wall = dir[axis] > 0.f ? (i >= 0 ? i + 1 : i) : (i > 0 ? i : i - 1);
+				return (float(wall) / inv_cell_size_[axis] - origin[axis]) / dir[axis];
+			};
+
+			float t0 = 0.f;
+			while (true)
+			{
+				const float exits[3] = { exit_t(0), exit_t(1), exit_t(2) };
+				const float t1 = (std::max)(t0, (std::min)({ exits[0], exits[1], exits[2], max_t }));
+				if (!fn(static_cast<const sim::size3_t&>(cell), t0, t1) || t1 >= max_t)
+				{
+					return;
+				}
+
+				for (std::size_t axis = 0; axis < 3; axis++)
+				{
+					if (exits[axis] <= t1)
+					{
+						cell[axis] += dir[axis] > 0.f ? 1 : std::uint32_t(-1);
+					}
+				}
+				t0 = t1;
+			}
 		}
 
+		// for_each_on_segment with d normalized, keep_marching(t0) is asked before every cell
+		template<typename Fn, typename MarchFn>
+		inline void visit_segment(const Eigen::Vector3f& origin, const Eigen::Vector3f& d, const float max_t, const float radius, Fn&& fn, MarchFn&& keep_marching) const
+		{
+			const float radius2 = radius * radius;
+			march_cells(origin, d, max_t, [&](const sim::size3_t& cell, const float t0, const float t1) {
+				if (!keep_marching(t0))
+				{
+					return false;
+				}
+
+				bool go_on = true;
+				const auto visit = [&](const std::uint32_t idx) {
+					// the point of the segment closest to the element is in exactly one cell of the march, the element is
+					// reported from there so neighboring cells of the march don't report it again
+					const Eigen::Vector3f v = sorted_elements_.position(idx) - origin;
+					const float t_proj = v.dot(d);
+					const float t_closest = std::clamp(t_proj, 0.f, max_t);
+					if (!go_on || t_closest < t0 || (t_closest >= t1 && t1 < max_t))
+					{
+						return;
+					}
+
+					const float perp2 = v.squaredNorm() - t_proj * t_proj;
+					const float half_chord2 = radius2 - perp2;
+					if (half_chord2 < 0.f)
+					{
+						return;
+					}
+					const float half_chord = std::sqrt(half_chord2);
+					if (t_proj - half_chord > max_t || t_proj + half_chord < 0.f)
+					{
+						return;
+					}
+					go_on = fn(idx, (std::max)(0.f, t_proj - half_chord));
+				};
+
+				const sim::size3_t lo = { cell[0] - 1, cell[1] - 1, cell[2] - 1 }, hi = { cell[0] + 1, cell[1] + 1, cell[2] + 1 };
+				if (!visit_cells(lo, hi, visit))
+				{
+					for (std::uint32_t idx = 0; idx < size() && go_on; idx++)
+					{
+						visit(idx);
+					}
+				}
+				return go_on;
+			});
+		}
+
+		void build_hash_table();
+		void build_dense_grid();
+
+		// count, scan, then fill so both passes can run in parallel without any per-element allocation. self means the
+		// queries are this table's own elements, query i then leaves element i out of its list.
+		// with blocks, a pair inside one block is only listed at its lower index and goes first, splits gets the count
+		void build_lists(const particle_soa& queries, const float radius, const bool self,
+			std::vector<std::uint32_t>& offsets, std::vector<std::uint32_t>& indices,
+			const std::uint32_t* blocks = nullptr, std::uint32_t* splits = nullptr) const;
+
+		static constexpr std::size_t radix_bits = 11;
+		static constexpr std::size_t radix = std::size_t(1) << radix_bits;
+
+		struct morton_index
+		{
+			uint64_t morton;
+			std::uint32_t index;
+		};
+
+		// a key with where it was in sort_keys_ before sorting, equal keys keep that order like in the radix sort
+		struct positioned_key : morton_index
+		{
+			std::uint32_t position;
+		};
+
+		// sorts order_ by morton through a key/index array, stable so equal keys keep their order from the last step
+		void sort_order();
+		// fraction of neighbors in order_ that are far apart in memory, 0 right after gather_elements()
+		float order_scatter() const;
+		// moves sorted_elements_ and mortons_ into morton order, order_ becomes the identity
+		void gather_elements();
+		// same, but without the removed elements and with added merged in
+		void splice_elements(const std::span<const std::uint8_t> removed, const std::span<const particle> added);
+		bool fixup_sort_keys();
+		void radix_sort_keys();
+
 	public:
 		spatial_hash_table() = default;
-		spatial_hash_table(const std::vector<particle>& elements, float cell_size);
+		spatial_hash_table(const std::vector<particle>& elements, float cell_size, const grid_backend backend = grid_backend::hash,
+			const reorder_policy& reorder = {});
 
-		void update();
+		// returns true if the elements were physically reordered, element indices from before are invalid then.
+		// removed is empty or a flag per element, the flagged ones get dropped and added merged in by morton code,
+		// which always reorders. last_gather() has new_element for the added ones
+		bool update(const std::span<const std::uint8_t> removed = {}, const std::span<const particle> added = {});
+		static constexpr std::uint32_t new_element = std::numeric_limits<std::uint32_t>::max();
+		// false runs every pass on the calling thread, on by default
+		void set_parallel(const bool parallel) { parallel_ = parallel; }
 
 		/*class neighbor_iterator
 		{
@@ -337,14 +868,170 @@ namespace sim
 
 		std::vector<particle> get_neighbors(const particle& elem) const;
 
+		/*
+		 * queries, they only read the table so any number of threads can run them at once as long as nothing updates
+		 * it, and none of them allocate. the element indices are valid until the next update()
+		 */
+
+		static constexpr std::uint32_t no_element = std::numeric_limits<std::uint32_t>::max();
+
+		// calls fn(idx, distance2) for every element within radius of p, radius can be anything. elements at p come
+		// back too, at distance 0, pass an element's own index as exclude to leave just that one out
+		template<typename Fn>
+		void for_each_in_radius(const Eigen::Vector3f& p, const float radius, Fn&& fn, const std::uint32_t exclude = no_element) const
+		{
+			const float radius2 = radius * radius;
+			const auto visit = [&](const std::uint32_t idx) {
+				const float distance2 = (sorted_elements_.position(idx) - p).squaredNorm();
+				if (distance2 <= radius2 && idx != exclude)
+				{
+					fn(idx, distance2);
+				}
+			};
+
+			// past a point it's cheaper to look at every element than at every cell
+			static constexpr float max_cells_per_axis = float(1 << 20);
+			const Eigen::Vector3f extent = mth::vec3f_replicate(radius);
+			if (!(radius * inv_cell_size_.maxCoeff() < max_cells_per_axis) || !visit_cells(to_uint_space(p - extent), to_uint_space(p + extent), visit))
+			{
+				for (std::uint32_t idx = 0; idx < size(); idx++)
+				{
+					visit(idx);
+				}
+			}
+		}
+
+		// calls fn(idx) for every element inside the box lo..hi
+		template<typename Fn>
+		void for_each_in_box(const Eigen::Vector3f& lo, const Eigen::Vector3f& hi, Fn&& fn) const
+		{
+			const auto visit = [&](const std::uint32_t idx) {
+				const Eigen::Vector3f pos = sorted_elements_.position(idx);
+				if ((pos.array() >= lo.array()).all() && (pos.array() <= hi.array()).all())
+				{
+					fn(idx);
+				}
+			};
+
+			static constexpr float max_cells_per_axis = float(1 << 20);
+			if (!((hi - lo).cwiseProduct(inv_cell_size_).maxCoeff() < max_cells_per_axis) || !visit_cells(to_uint_space(lo), to_uint_space(hi), visit))
+			{
+				for (std::uint32_t idx = 0; idx < size(); idx++)
+				{
+					visit(idx);
+				}
+			}
+		}
+
+		// the up to hits.size() elements nearest to p within max_radius, nearest first. returns how many were found
+		std::size_t nearest(const Eigen::Vector3f& p, const std::span<query_hit> hits, const float max_radius = std::numeric_limits<float>::max()) const;
+
+		// calls fn(idx, t) for every element whose sphere of radius overlaps the segment origin + dir * [0, max_t],
+		// t is where the segment enters the sphere, 0 if it starts inside. dir gets normalized so t is a distance.
+		// elements come cell by cell along the segment, roughly front to back, fn returns false to stop.
+		// radius must be <= the cell size
+		template<typename Fn>
+		void for_each_on_segment(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, const float max_t, const float radius, Fn&& fn) const
+		{
+			visit_segment(origin, dir.normalized(), max_t, radius, fn, [](const float) { return true; });
+		}
+
+		// the element for_each_on_segment would report with the smallest t
+		std::optional<ray_hit> raycast(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, const float max_t, const float radius) const;
+
+		// builds persistent CSR neighbor lists (element indices) for every element within radius,
+		// radius must be <= the cell size. Lists stay valid until the next update()
+		void build_neighbor_lists(const float radius);
+
+		// CSR lists of the elements of this table within radius of each query, indexed by query.
+		// radius must be <= the cell size
+		void build_query_lists(const particle_soa& queries, const float radius,
+			std::vector<std::uint32_t>& offsets, std::vector<std::uint32_t>& indices) const;
+
+		// like build_neighbor_lists, but order_ is cut into num_blocks contiguous blocks and a pair inside a block is
+		// only listed once. pairs that straddle two blocks are listed from both sides, so each block can add to both
+		// ends of its own pairs without racing the others
+		void build_symmetric_neighbor_lists(const float radius, const std::uint32_t num_blocks);
+
+		inline std::span<const std::uint32_t> neighbors(const std::size_t i) const
+		{
+			const std::uint32_t* begin = neighbor_indices_.data();
+			return std::span<const std::uint32_t>(begin + neighbor_offsets_[i], begin + neighbor_offsets_[i + 1]);
+		}
+
+		// symmetric lists only, neighbors in the same block that count for both elements
+		inline std::span<const std::uint32_t> mutual_neighbors(const std::size_t i) const
+		{
+			const std::uint32_t* begin = neighbor_indices_.data() + neighbor_offsets_[i];
+			return std::span<const std::uint32_t>(begin, begin + neighbor_splits_[i]);
+		}
+
+		// symmetric lists only, neighbors in other blocks that only count for i
+		inline std::span<const std::uint32_t> cross_neighbors(const std::size_t i) const
+		{
+			const std::uint32_t* begin = neighbor_indices_.data();
+			return std::span<const std::uint32_t>(begin + neighbor_offsets_[i] + neighbor_splits_[i], begin + neighbor_offsets_[i + 1]);
+		}
+
+		inline std::uint32_t num_blocks() const { return num_blocks_; }
+
+		// elements of range b out of num equal ranges of order_, in morton order
+		inline std::span<const std::uint32_t> morton_range(const std::size_t b, const std::size_t num) const
+		{
+			const std::uint32_t* begin = order_.data();
+			return std::span<const std::uint32_t>(begin + std::uint64_t(b) * order_.size() / num, begin + std::uint64_t(b + 1) * order_.size() / num);
+		}
+
+		// elements of block b of the symmetric lists
+		inline std::span<const std::uint32_t> block(const std::size_t b) const { return morton_range(b, num_blocks_); }
+
 		inline std::size_t size() const { return sorted_elements_.size(); }
 
-		inline const particle& operator[](const size_t i) const { return sorted_elements_[i]; }
-		inline particle& operator[](const size_t i) { return sorted_elements_[i]; }
+		// element i was element last_gather()[i] before the last physical reorder, for keeping per element data in step
+		inline std::span<const std::uint32_t> last_gather() const { return gather_order_; }
+
+		// the elements by index, positions can be changed in place until the next update()
+		inline const particle_soa& elements() const { return sorted_elements_; }
+		inline particle_soa& elements() { return sorted_elements_; }
+		// element i as a particle, and all of them, for when they leave the table
+		particle element(const std::size_t i) const;
+		void copy_elements(std::vector<particle>& out) const;
 
 		Eigen::Vector3f inv_cell_size_;
-		std::vector<particle> sorted_elements_;
+		grid_backend backend_;
+		reorder_policy reorder_;
+		std::uint32_t updates_since_reorder_;
+		bool parallel_ = true;
+		particle_soa sorted_elements_; // only in morton order right after a reorder, order_ always is
+		std::vector<uint64_t> mortons_; // of the cell each element was in at the last update
+		std::vector<std::uint32_t> order_; // element indices in morton order, the cells index into this
 		std::unordered_map<uint64_t, size_t> grid_table_;
+
+		// dense backend, cells are uint space coords >> dense_level_ so they stay contiguous in morton order
+		std::uint32_t dense_level_;
+		sim::size3_t dense_min_;
+		sim::size3_t dense_dims_;
+		std::vector<std::uint32_t> element_cells_;
+		std::vector<std::uint32_t> cell_start_;
+		std::vector<std::uint32_t> cell_end_;
+		std::vector<std::uint32_t> neighbor_offsets_;
+		std::vector<std::uint32_t> neighbor_indices_;
+		std::uint32_t num_blocks_; // 0 unless the lists are symmetric
+		std::vector<std::uint32_t> element_blocks_;
+		std::vector<std::uint32_t> neighbor_splits_;
+
+		// scratch for sort_order, kept around so sorting doesn't allocate every step
+		std::vector<morton_index> sort_keys_;
+		std::vector<morton_index> sort_scratch_;
+		std::vector<morton_index> sort_added_; // elements spliced in by update
+		std::vector<uint64_t> sort_max_; // largest key kept up to each position in fixup_sort_keys
+		std::vector<positioned_key> sort_kept_;
+		std::vector<positioned_key> sort_moved_;
+		std::vector<std::size_t> chunk_offsets_;
+		std::vector<std::array<std::size_t, radix>> radix_offsets_;
+		particle_soa element_scratch_;
+		std::vector<uint64_t> morton_scratch_;
+		std::vector<std::uint32_t> gather_order_;
 	};
 
 	// q in range 0 <= q 
@@ -379,12 +1066,172 @@ namespace sim
 			return 0;
 		}
 	}
+
+	// adaptive time stepping for sph_sim::advance, dt = min(cfl * h / v_max, force * sqrt(h / a_max), max_dt)
+	struct substep_params
+	{
+		float cfl = .4f;
+		float force = .25f;
+		float min_dt = 1e-6f;
+		float max_dt = .005f;
+		std::uint32_t max_substeps = 256; // the frame always finishes, substeps get longer than the criteria if needed
+	};
+
+	enum class pressure_solver : std::uint8_t
+	{
+		state_equation, // pressure straight from the stiff equation of state, needs tiny steps
+		pcisph // predictive-corrective, iterates pressure until the predicted density error is under tolerance
+	};
+
+	struct pcisph_params
+	{
+		float tolerance = .01f; // max compression relative to the resting density
+		std::uint32_t min_iterations = 3;
+		std::uint32_t max_iterations = 50;
+		float relaxation = .5f; // fraction of the pressure correction applied per iteration, full steps overshoot next to walls
+		float max_correction_rate = 20.f; // compression removed per second at most, relative to the resting density, so overlaps resolve gently
+	};
+
+	// a tile of particles that all stayed under both thresholds for rest_steps steps goes to sleep, its particles are
+	// frozen and skipped by every pass until a moving neighbor wakes the tile up again
+	struct sleep_params
+	{
+		float max_speed = .02f;
+		float max_acceleration = .5f;
+		std::uint32_t rest_steps = 20;
+	};
+
+	// fluid inflow for sph_sim::add_emitter
+	enum class emitter_shape : std::uint8_t
+	{
+		box, // keeps the box full
+		nozzle // a disc normal to the velocity, emits a layer whenever the last one has flowed off it
+	};
+
+	struct emitter
+	{
+		emitter_shape shape;
+		range3_t box; // box only
+		Eigen::Vector3f center; // nozzle only
+		float radius; // nozzle only
+		Eigen::Vector3f velocity;
+	};
+
+	// triple buffer handing completed states from one writer thread to one reader thread without locks. the writer
+	// fills back() and publishes it, the reader picks up the latest published buffer, so neither ever waits on the
+	// other and states the reader was too slow for get skipped
+	template<typename T>
+	class snapshot_buffer
+	{
+		static constexpr std::uint32_t fresh_bit = 4;
+		static constexpr std::uint32_t index_mask = 3;
+
+	public:
+		snapshot_buffer() : buffers_(), back_(0), middle_(1), front_(2) {}
+
+		snapshot_buffer(const snapshot_buffer&) = delete;
+		snapshot_buffer& operator=(const snapshot_buffer&) = delete;
+
+		// writer side, back() is reused so refilling the vectors in it doesn't allocate
+		inline T& back() { return buffers_[back_]; }
+		inline void publish()
+		{
+			back_ = middle_.exchange(back_ | fresh_bit, std::memory_order_acq_rel) & index_mask;
+		}
+
+		// reader side, swaps in the latest published buffer and returns false if nothing was published since last time
+		inline bool fetch()
+		{
+			if (!(middle_.load(std::memory_order_relaxed) & fresh_bit))
+			{
+				return false;
+			}
+			front_ = middle_.exchange(front_, std::memory_order_acq_rel) & index_mask;
+			return true;
+		}
+		inline const T& front() const { return buffers_[front_]; }
+
+	private:
+		std::array<T, 3> buffers_;
+		std::uint32_t back_;
+		alignas(64) std::atomic<std::uint32_t> middle_; // index of the spare buffer, fresh_bit once it holds something new
+		alignas(64) std::uint32_t front_;
+	};
+
+	// wall clock time spent per phase, accumulated over steps until reset
+	struct step_timings
+	{
+		using duration = std::chrono::duration<double>;
+		duration density = {}; // density sums and pressure, including the ones inside the pcisph loop
+		duration force = {}; // force sums and forces, including the pcisph pressure forces
+		duration grid = {}; // spatial_hash_table::update
+		duration neighbors = {}; // neighbor list rebuilds
+		std::uint64_t steps = 0;
+	};
+
+	// persistent worker threads that run a function over tiles, contiguous ranges of particles in morton order.
+	// each thread starts on its own run of tiles, cut so the estimated costs even out, and keeps the same part
+	// of the sim from step to step while the costs don't change much. when its run is done it steals single tiles
+	// from the back of the other runs
+	class tile_scheduler
+	{
+	public:
+		// threads: 0 uses every cpu the process may run on. pin_threads: workers stay on one of those cpus each (linux
+		// only for now), only worth it when nothing else runs on them. throws std::runtime_error if pinning fails
+		explicit tile_scheduler(const std::uint32_t threads = 0, const bool pin_threads = false);
+		~tile_scheduler();
+
+		tile_scheduler(const tile_scheduler&) = delete;
+		tile_scheduler& operator=(const tile_scheduler&) = delete;
+
+		// the one sims run on unless they get their own, created on first use and gone with the last sim using it.
+		// every sim in the process sharing it keeps them from oversubscribing the cpus with a pool each
+		static std::shared_ptr<tile_scheduler> shared();
+
+		// calls fn for tiles [0, tile_costs.size()) and returns once they're all done, the calling thread helps out.
+		// runs from different threads take turns
+		void run(const std::span<const float> tile_costs, const std::function<void(std::uint32_t)>& fn);
+
+		inline std::uint32_t num_threads() const { return std::uint32_t(runs_.size()); }
+
+	private:
+		// front and back tile of a run packed together, so the owner and thieves can claim with a single cas
+		struct alignas(64) tile_run
+		{
+			std::atomic<std::uint64_t> range;
+		};
+
+		void worker(const std::uint32_t thread);
+		void work(const std::uint32_t thread);
+		void stop();
+
+		std::vector<tile_run> runs_;
+		std::vector<std::thread> workers_;
+		const std::function<void(std::uint32_t)>* fn_;
+
+		std::mutex run_mutex_;
+		std::mutex mutex_;
+		std::condition_variable start_cv_;
+		std::condition_variable done_cv_;
+		std::uint64_t generation_;
+		std::uint32_t busy_;
+		bool stop_;
+	};
+
+	enum class pair_evaluation : std::uint8_t
+	{
+		gather, // every particle sums over all of its neighbors, so each pair gets evaluated from both sides
+		symmetric // pairs within a thread's block of particles are evaluated once and added to both
+	};
 }
 
 class sph_sim
 {
 	// for sampling the kernel function
 	static constexpr size_t num_kernel_samples = 1028;
+	// particles per scheduler tile, there are always at least a few tiles per thread to steal
+	static constexpr std::uint32_t tile_size = 1024;
+	static constexpr std::uint32_t min_tiles_per_thread = 4;
 	static constexpr float min_domain = 2.f;
 	static constexpr float step = min_domain / float(num_kernel_samples - 1);
 	static constexpr float inv_step = 1.f / step;
@@ -395,10 +1242,20 @@ public:
 	 * h: smoothing length
 	 * p0: resting density
 	 * k: stiffness constant
-	 * dt: time step
+	 * skin: verlet skin added to the neighbor search radius, lists are only rebuilt once
+	 *       a particle moves more than skin / 2. 0 rebuilds every step
+	 * backend: cell lookup structure used by the neighbor search
+	 * reorder: how often the particles themselves are moved into morton order, only the index order is sorted otherwise
+	 * rand: scatters the particles in block, reset() starts over from the same state
+	 * container: boundary box the sim starts in, see add_boundary_box. std::nullopt starts without any boundaries
 	 */
 	sph_sim(const sim::range3_t& block, const std::size_t num_particles,
-		const float h, const float p0, const float k);
+		const float h, const float p0, const float k, const float skin = 0.f,
+		const sim::grid_backend backend = sim::grid_backend::hash, const sim::reorder_policy& reorder = {},
+		const mth::pcg32& rand = {}, const std::optional<sim::range3_t>& container = default_container);
+
+	// 6 units around the origin, where the old penalty walls were
+	static const sim::range3_t default_container;
 
 	inline float sample_kernel(const float q) const
 	{
@@ -422,15 +1279,139 @@ public:
 		return dhdd * -dqdh;
 	}
 
+	void set_pressure_solver(const sim::pressure_solver solver, const sim::pcisph_params& params = {}) { pressure_solver_ = solver; pcisph_params_ = params; max_pressure_force_ = 0.f; }
+	void set_viscosity(const float viscosity) { viscosity_ = viscosity; }
+	void set_pair_evaluation(const sim::pair_evaluation mode);
+	// off by default, turning it on or off wakes everything
+	void set_sleeping(const bool enabled, const sim::sleep_params& params = {});
+	// the per particle passes run on scheduler, several sims can share one. it's tile_scheduler::shared() until set.
+	// with a single thread the rest of the step runs on the calling thread too, for stepping many small sims side by side
+	void set_scheduler(std::shared_ptr<sim::tile_scheduler> scheduler);
+
+	// static boundary particles sampled at spacing h, they add to the density of the fluid near them and push back
+	// with its pressure. a box is a container, sampled as a shell as thick as the kernel support, and particles are
+	// also clamped inside it. the samples go with the area of the box over h^2, so a scene much smaller than the
+	// default container is better off passing its own to the constructor
+	void add_boundary_box(const sim::range3_t& box);
+	void add_boundary_mesh(const std::vector<Eigen::Vector3f>& verts, const std::vector<sim::size3_t>& inds);
+	void clear_boundaries();
+
+	// emitters are sampled at spacing h and a sample emits a particle moving at the emitter's velocity whenever no
+	// particle is within h of it. sinks remove every particle inside them. both get applied when the grid is updated,
+	// which with a skin is whenever something moved half of it, survivors keep their morton order and new particles
+	// get merged in by morton code so neither needs a sort
+	void add_emitter(const sim::emitter& emitter);
+	void add_sink(const sim::range3_t& box);
+	void clear_emitters();
+	void clear_sinks();
+
+	// single step with a fixed dt
 	void update(float dt);
+	// advances frame_dt in as many substeps as the cfl and force criteria need, returns the substep count
+	std::uint32_t advance(const float frame_dt, const sim::substep_params& params = {});
 	// TODO: dampening force
 
-	draw_item draw_item(rhi::device* device, rhi::buffer* d_mvp_buf); // doesn't work
+	const sim::step_timings& timings() const { return timings_; }
+	void reset_timings() { timings_ = {}; }
+	std::size_t size() const { return grid_.size(); }
+	std::size_t num_sleeping() const;
+	float smoothing_length() const { return 1.f / inv_h_; }
+	float rest_density() const { return 1.f / inv_p0_; }
+	// in the sim's own order, which changes whenever the particles get reordered
+	const sim::particle_soa& particles() const { return grid_.elements(); }
+	// the same as particles, for checkpoints and particle caches
+	void copy_particles(std::vector<sim::particle>& out) const { grid_.copy_elements(out); }
+	// for radius, nearest and ray queries, element indices are indices into particles()
+	const sim::spatial_hash_table& grid() const { return grid_; }
+
+	// positions of the last finished frame, safe to read from another thread than the one stepping the sim with
+	// fetch() and front(). the vector is as long as the sim was then, emitters and sinks change that from frame to
+	// frame. nothing gets published until a reader attached here or through draw_item()
+	sim::snapshot_buffer<std::vector<Eigen::Vector3f>>& snapshots()
+	{
+		snapshot_reader_.store(true, std::memory_order_relaxed);
+		return snapshots_;
+	}
+	// hands the current positions to snapshots(), on the thread stepping the sim. advance() does it once per frame,
+	// callers stepping with update() call it after the last substep of theirs
+	void publish_snapshot();
+
+	// particles, boundaries, parameters and the rng to a versioned binary file (see checkpoint.hpp). loading maps it
+	// and only rebuilds the grids, the scheduler isn't part of the state so it starts with a default one.
+	// both throw std::runtime_error
+	void save_checkpoint(const std::string& filename) const;
+	static std::unique_ptr<sph_sim> load_checkpoint(const std::string& filename);
+
+#if !defined(XS_HEADLESS)
+	// the buffer holds up to max_particles, anything past that gets dropped and the points past the snapshot's end
+	// are nan so they don't get drawn
+	draw_item draw_item(rhi::device* device, rhi::buffer* d_mvp_buf, const std::size_t max_particles); // doesn't work
+#endif
 
 	void reset();
 
 private:
-	sim::spatial_hash_table grid_;
+	// everything else gets filled in by load_checkpoint
+	sph_sim();
+
+	void sample_kernels();
+	void rebuild_neighbors(const bool reordered);
+	void build_boundary();
+	// puts tiles that have been at rest long enough to sleep and wakes the ones a moving particle got close to
+	void update_sleep();
+	void gather_rest_steps();
+	void collect_awake_tiles();
+	void sample_emitter(const sim::emitter& emitter);
+	// updates the grid without the particles in the sinks and with new ones at the free emitter samples,
+	// max_displacement is how far a particle moved since the last update at most
+	bool update_flow(const float max_displacement);
+
+	// fn(tile) for every awake tile on the scheduler
+	template<typename Fn>
+	void for_each_tile(const Fn& fn)
+	{
+		scheduler_->run(awake_costs_, [&](const std::uint32_t t) {
+			fn(awake_tiles_[t]);
+		});
+	}
+
+	// fn(i) for every awake particle, tile by tile
+	template<typename Fn>
+	void for_each_particle(const Fn& fn)
+	{
+		for_each_tile([&](const std::uint32_t tile) {
+			for (const std::uint32_t i : grid_.morton_range(tile, tile_costs_.size()))
+			{
+				fn(i);
+			}
+		});
+	}
+
+	// fills density/pressure and forces_ for the current positions, forces_ has no pressure force with pcisph
+	void compute_forces();
+	// adds the pcisph pressure forces to forces_
+	void solve_pressure(const float dt);
+	void integrate(const float dt);
+
+	// kernel sums of every particle into density_sums_, del_pressures_ and del2_velocities_
+	void density_kernel_sums(const sim::particle_soa& soa);
+	void force_kernel_sums(const sim::particle_soa& soa);
+
+	// kernel sums over the given neighbors of particle i, read from soa 8 neighbors at a time when built with avx2
+	float density_kernel_sum(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa) const;
+	void force_kernel_sum(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa,
+		Eigen::Vector3f& del_pressure, Eigen::Vector3f& del2_velocity) const;
+	// same for pairs that are only listed once, the mirrored terms get added to the neighbors' entries in the output arrays
+	float density_kernel_scatter(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa, float* sums) const;
+	void force_kernel_scatter(const std::size_t i, const std::span<const std::uint32_t> neighbors, const sim::particle_soa& soa,
+		Eigen::Vector3f& del_pressure, Eigen::Vector3f& del2_velocity, Eigen::Vector3f* del_pressures, Eigen::Vector3f* del2_velocities) const;
+	// same for the boundary particles around particle i, volume weighted kernel and kernel gradient sums
+	float boundary_density_sum(const std::size_t i, const sim::particle_soa& soa) const;
+	Eigen::Vector3f boundary_gradient_sum(const std::size_t i, const sim::particle_soa& soa) const;
+
+	sim::spatial_hash_table grid_; // owns the particles
+	std::vector<Eigen::Vector3f> forces_;
+	std::vector<Eigen::Vector3f> list_positions_; // positions at the last neighbor list rebuild
 
 	std::array<float, num_kernel_samples> kernel_;
 	std::array<float, num_kernel_samples> dkernel_;
@@ -440,13 +1421,124 @@ private:
 	float h2_;
 	float inv_p0_;
 	float k_;
+	float viscosity_;
 	float mass_;
+	float skin_;
+	sim::grid_backend grid_backend_;
+	sim::reorder_policy reorder_;
+
+	sim::pressure_solver pressure_solver_;
+	sim::pcisph_params pcisph_params_;
+	sim::pair_evaluation pair_evaluation_;
+	std::vector<float> density_sums_;
+	std::vector<Eigen::Vector3f> del_pressures_;
+	std::vector<Eigen::Vector3f> del2_velocities_;
+	float pcisph_delta_; // pcisph pressure per unit of density error, times dt^2
+	sim::particle_soa predicted_;
+	std::vector<Eigen::Vector3f> pressure_forces_;
+	float max_pressure_force_; // of the last pcisph solve, forces_ don't have the pressure when advance() picks a step
+	std::vector<float> target_densities_;
+	std::vector<float> errors_;
+
+	std::vector<Eigen::Vector3f> boundary_samples_;
+	std::vector<sim::range3_t> containers_;
+	sim::spatial_hash_table boundary_grid_;
+	std::vector<float> boundary_volumes_; // per boundary element, rest density / kernel sum over the other boundary particles
+	std::vector<std::uint32_t> boundary_offsets_; // CSR boundary neighbors of every fluid particle
+	std::vector<std::uint32_t> boundary_indices_;
+
+	std::vector<sim::emitter> emitters_;
+	std::vector<sim::particle> emitter_samples_; // at spacing h over every emitter, moving at its velocity
+	std::vector<sim::range3_t> sinks_;
+	bool flow_changed_; // emitters or sinks were added, the next step updates the grid even if nothing moved
+	std::vector<std::uint8_t> removed_;
+	std::vector<std::uint8_t> free_samples_;
+	std::vector<sim::particle> emitted_;
+
+	std::shared_ptr<sim::tile_scheduler> scheduler_;
+	bool parallel_; // the scheduler has more than one thread
+	std::vector<float> tile_costs_; // neighbor counts of each tile at the last list rebuild
+	std::vector<std::uint32_t> awake_tiles_;
+	std::vector<float> awake_costs_;
+
+	bool sleeping_;
+	sim::sleep_params sleep_params_;
+	std::vector<std::uint32_t> rest_steps_; // consecutive steps each particle has been at rest, capped at rest_steps
+	std::vector<std::uint32_t> rest_scratch_;
+	std::vector<std::uint32_t> particle_tiles_;
+	std::vector<std::uint8_t> tile_asleep_;
+	std::vector<std::uint8_t> tile_wake_;
 
 	sim::range3_t block_;
+	std::size_t initial_size_; // particles scattered in block_ by the constructor and reset()
+	mth::pcg32 rand_;
+	sim::step_timings timings_;
+	sim::snapshot_buffer<std::vector<Eigen::Vector3f>> snapshots_;
+	std::atomic<bool> snapshot_reader_;
 
+#if !defined(XS_HEADLESS)
+	std::size_t max_drawn_;
+	std::size_t drawn_particles_;
 	rhi::device::scoped_mmap<Eigen::Vector3f> d_verts_view_;
 	rhi::device::ptr<rhi::buffer> d_verts_buf_;
 	rhi::device::ptr<rhi::uniform_set> d_mvp_uniforms_;
+#endif
 };
 
-}
\ No newline at end of file
+/*
+ * a batch of small independent sph sims for parameter sweeps, all set up the same except for their own k, p0 and
+ * viscosity. a sim of a few thousand particles is too little work to spread over every thread, so the members get
+ * stepped side by side instead, each one start to finish on the thread that picked it up. members have a single
+ * thread scheduler, which keeps every pass of their step on that thread.
+ * the members aren't packed into one array. a sph_sim can't be moved and keeps its particles in its own channels
+ * anyway, and no two threads ever touch the same member within a step, so packing would only put the small member
+ * objects next to each other
+ */
+class sph_ensemble
+{
+public:
+	struct member_params
+	{
+		float p0 = 1000.f;
+		float k = 1.f;
+		float viscosity = .001f;
+	};
+
+	// one member per entry of members, the rest as in sph_sim. every member starts from the same particles in the
+	// same container
+	sph_ensemble(const sim::range3_t& block, const std::size_t num_particles, const float h,
+		const std::vector<member_params>& members, const float skin = 0.f,
+		const sim::grid_backend backend = sim::grid_backend::hash, const sim::reorder_policy& reorder = {},
+		const mth::pcg32& rand = {}, const std::optional<sim::range3_t>& container = sph_sim::default_container);
+
+	std::size_t size() const { return members_.size(); }
+	// for setting up the members and reading them back, not while the ensemble is stepping
+	sph_sim& operator[](const std::size_t i) { return *members_[i]; }
+	const sph_sim& operator[](const std::size_t i) const { return *members_[i]; }
+	const member_params& params(const std::size_t i) const { return params_[i]; }
+
+	// fn(i, member) for every member in parallel
+	template<typename Fn>
+	void for_each_member(const Fn& fn)
+	{
+		const std::int64_t n = std::int64_t(members_.size());
+#pragma omp parallel for schedule(dynamic, 1)
+		for (std::int64_t i = 0; i < n; i++)
+		{
+			fn(std::size_t(i), *members_[i]);
+		}
+	}
+
+	void update(const float dt);
+	// every member takes as many substeps as it needs, returns the counts by member
+	std::span<const std::uint32_t> advance(const float frame_dt, const sim::substep_params& params = {});
+
+	void reset();
+
+private:
+	std::vector<member_params> params_;
+	std::vector<std::unique_ptr<sph_sim>> members_; // sph_sim can't be moved, so one allocation each
+	std::vector<std::uint32_t> substeps_;
+};
+
+}
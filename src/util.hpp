@@ -5,6 +5,7 @@
 #include <bit>
 #include <string>
 #include <fstream>
+#include <stdexcept>
 
 #define assert_not_implemented assert(false);
 #define assert_not_reached assert(false);
@@ -387,7 +388,7 @@ void swap(fvector<T, AllocMgr>& a, fvector<T, AllocMgr>& b)
 	swap(a.size_, b.size_);
 }
 
-template<typename T, typename AllocMgr = owning_heap_alloc_mgr<T>>
+template<typename T, typename AllocMgr>
 class fvector : public vector_base<fvector<T, AllocMgr>>
 {
 public:
@@ -738,7 +739,7 @@ namespace util
 	template<typename T>
 	constexpr std::size_t bitsof()
 	{
-		static constexpr std::size_t bits_in_byte = 8;
+		constexpr std::size_t bits_in_byte = 8;
 		return sizeof(T) * bits_in_byte;
 	}
 
@@ -1112,6 +1113,30 @@ namespace util
 		return o;
 	}
 
+	// half->float counterpart of the above, from the same source. exact for every half, denormals included
+	static FP32 half_to_float(const FP16 h)
+	{
+		static constexpr FP32 magic = { 113 << 23 };
+		static constexpr uint shifted_exp = 0x7c00 << 13; // exponent mask after shift
+		FP32 o;
+
+		o.u = (h.u & 0x7fff) << 13; // exponent/mantissa bits
+		const uint exp = shifted_exp & o.u; // just the exponent
+		o.u += (127 - 15) << 23; // exponent adjust
+
+		// handle exponent special cases
+		if (exp == shifted_exp) // Inf/NaN?
+			o.u += (128 - 16) << 23; // extra exp adjust
+		else if (exp == 0) // Zero/Denormal?
+		{
+			o.u += 1 << 23; // extra exp adjust
+			o.f -= magic.f; // renormalize
+		}
+
+		o.u |= (h.u & 0x8000) << 16; // sign bit
+		return o;
+	}
+
 	// Approximate solution. This is faster but converts some sNaNs to
 	// infinity and doesn't round correctly. Handle with care.
 	static FP16 approx_float_to_half(const float ff)